@@ -0,0 +1,97 @@
+//
+//  CheckpointWriter.h
+//  Mnist_Multi_Layers
+//
+//  Background thread that writes checkpoints while training goes on.
+//  submit() only copies the weights into a memory image, the file is
+//  written and renamed into place by the writer thread. If a snapshot
+//  arrives while the previous one is still being written, the newest
+//  waiting snapshot wins.
+//
+
+#ifndef CheckpointWriter_h
+#define CheckpointWriter_h
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "Checkpoint.h"
+
+
+class CheckpointWriter {
+public:
+    CheckpointWriter(const std::string& path) : path(path), tmpPath(path + ".tmp") {
+        hasNext = false;
+        busy = false;
+        stop = false;
+        writer = std::thread(&CheckpointWriter::writeLoop, this);
+    }
+
+    // Writes the last submitted snapshot before returning
+    ~CheckpointWriter() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stop = true;
+        }
+        wake.notify_one();
+        writer.join();
+    }
+
+    // Snapshots the weights of nn, the caller only waits for the copy
+    template <typename Network>
+    void submit(Network& nn) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            nn.snapshotWeights(next);
+            hasNext = true;
+        }
+        wake.notify_one();
+    }
+
+    // Blocks until every submitted snapshot is on disk
+    void wait() {
+        std::unique_lock<std::mutex> lock(mtx);
+        idle.wait(lock, [this] { return !hasNext && !busy; });
+    }
+
+private:
+    void writeLoop() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (true) {
+            wake.wait(lock, [this] { return hasNext || stop; });
+            if (!hasNext) {
+                return;
+            }
+            next.swap(current);
+            hasNext = false;
+            busy = true;
+            lock.unlock();
+
+            if (!writeCheckpointFile(path, tmpPath, current.data(), current.size())) {
+                std::cerr << "Unable to write checkpoint " << path << std::endl;
+            }
+
+            lock.lock();
+            busy = false;
+            idle.notify_all();
+        }
+    }
+
+    std::string path;
+    std::string tmpPath;
+    std::vector<char> next;     // filled by submit
+    std::vector<char> current;  // being written
+    std::thread writer;
+    std::mutex mtx;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    bool hasNext;
+    bool busy;
+    bool stop;
+};
+
+
+#endif /* CheckpointWriter_h */
@@ -0,0 +1,169 @@
+//
+//  DataPipeline.h
+//  Mnist_Multi_Layers
+//
+//  Producer thread that prepares training samples ahead of the trainer:
+//  per-epoch shuffling, normalization, foreground pixel lists and
+//  one-hot targets go into a bounded ring of preallocated slots, so the
+//  training thread only reads ready buffers and never allocates.
+//
+
+#ifndef DataPipeline_h
+#define DataPipeline_h
+
+#include <vector>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <iostream>
+#include <cstdlib>
+#include "readFiles.h"
+
+
+struct Sample {
+    std::vector<float> input;
+    std::vector<float> target;
+    std::vector<int> foreground;    // non-background pixels, see MnistImages::foreground
+    int label;
+    int index;                  // position in the dataset
+};
+
+class DataPipeline {
+public:
+    DataPipeline(const MnistImages &images, const MnistLabels &labels, int numClasses, float targetOff, float targetOn, bool shuffle = true, int capacity = 256)
+        : images(images), labels(labels), targetOff(targetOff), targetOn(targetOn), shuffle(shuffle)
+    {
+        // The producer thread indexes labels and targets with these, check them first
+        if (images.size() == 0) {
+            std::cerr << "No images to train on" << std::endl;
+            exit(1);
+        }
+        if (labels.size() < images.size()) {
+            std::cerr << "Only " << labels.size() << " labels for " << images.size() << " images" << std::endl;
+            exit(1);
+        }
+        for (int i = 0; i < images.size(); i++) {
+            if (labels[i] < 0 || labels[i] >= numClasses) {
+                std::cerr << "Label " << labels[i] << " of image " << i << " is not below " << numClasses << std::endl;
+                exit(1);
+            }
+        }
+        slots.resize(capacity);
+        for (Sample& slot : slots) {
+            slot.input.resize(images.imageSize());
+            slot.foreground.reserve(images.imageSize());
+            slot.target.assign(numClasses, targetOff);
+            slot.label = 0;
+            slot.index = 0;
+        }
+        order.resize(images.size());
+        for (int i = 0; i < (int)order.size(); i++) {
+            order[i] = i;
+        }
+        std::random_device rd;
+        gen.seed(rd());
+
+        produced = 0;
+        consumed = 0;
+        holding = false;
+        stop = false;
+        producerWaiting = false;
+        consumerWaiting = false;
+        producer = std::thread(&DataPipeline::produce, this);
+    }
+
+    ~DataPipeline() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stop = true;
+        }
+        notFull.notify_one();
+        producer.join();
+    }
+
+    // Next sample of the endless shuffled stream, one epoch is images.size()
+    // calls. The returned slot stays valid until the following call.
+    const Sample& next() {
+        if (holding) {
+            long long used = consumed.fetch_add(1) + 1;
+            // Wake a blocked producer once half the ring is free, so it refills in bursts
+            if (producerWaiting.load() && produced.load() - used <= (long long)slots.size() / 2) {
+                std::lock_guard<std::mutex> lock(mtx);
+                notFull.notify_one();
+            }
+        }
+        long long ready = consumed.load();
+        if (produced.load(std::memory_order_acquire) == ready) {
+            std::unique_lock<std::mutex> lock(mtx);
+            consumerWaiting = true;
+            notEmpty.wait(lock, [&] { return produced.load() != ready; });
+            consumerWaiting = false;
+        }
+        holding = true;
+        return slots[ready % slots.size()];
+    }
+
+private:
+    void produce() {
+        long long position = 0;
+        int numSamples = (int)order.size();
+        while (true) {
+            if (position % numSamples == 0 && shuffle) {
+                std::shuffle(order.begin(), order.end(), gen);
+            }
+
+            // Wait for a free slot
+            if (produced.load() - consumed.load() >= (long long)slots.size()) {
+                std::unique_lock<std::mutex> lock(mtx);
+                producerWaiting = true;
+                notFull.wait(lock, [&] { return stop || produced.load() - consumed.load() <= (long long)slots.size() / 2; });
+                producerWaiting = false;
+            }
+            if (stop) {
+                return;
+            }
+
+            Sample& slot = slots[produced.load() % slots.size()];
+            int index = order[position % numSamples];
+            images.normalize(index, slot.input.data());
+            images.foreground(index, slot.foreground);
+            std::fill(slot.target.begin(), slot.target.end(), targetOff);
+            slot.label = labels[index];
+            slot.target[slot.label] = targetOn;
+            slot.index = index;
+            position++;
+
+            produced.fetch_add(1);
+            if (consumerWaiting.load()) {
+                std::lock_guard<std::mutex> lock(mtx);
+                notEmpty.notify_one();
+            }
+        }
+    }
+
+    const MnistImages &images;
+    const MnistLabels &labels;
+    float targetOff;
+    float targetOn;
+    bool shuffle;
+    std::vector<Sample> slots;
+    std::vector<int> order;
+    std::mt19937 gen;
+
+    std::thread producer;
+    std::mutex mtx;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+    std::atomic<long long> produced;
+    std::atomic<long long> consumed;
+    std::atomic<bool> producerWaiting;
+    std::atomic<bool> consumerWaiting;
+    std::atomic<bool> stop;
+    bool holding;
+};
+
+
+#endif /* DataPipeline_h */
@@ -0,0 +1,251 @@
+//
+//  Profiler.h
+//  Mnist_Multi_Layers
+//
+//  Per layer and per phase timing when built with -DANN_PROFILE. The
+//  layers wrap each phase in ANN_PROFILE_SCOPE(layer, phase, flops, bytes),
+//  which records the wall time of the scope with the floating point
+//  operations and the bytes of weights and vectors it touches. Every
+//  thread keeps its own sums and trace events, main prints the summary
+//  table and writes a Chrome trace (chrome://tracing, Perfetto) after
+//  each epoch. Without the flag the scopes compile to nothing.
+//
+
+#ifndef Profiler_h
+#define Profiler_h
+
+#ifdef ANN_PROFILE
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+enum ProfilePhase {
+    PhaseEval,          // Z = W x + bias
+    PhaseActivation,    // Y = f(Z)
+    PhaseGradient,      // dE_dZ = f'(Z) * dE_dY
+    PhaseBackprop,      // dE_dX = W^T dE_dZ
+    PhaseUpdate,        // weights and node parameters
+    PhaseBackpropUpdate,// dE_dX and W in one pass over the rows
+    NumPhases
+};
+
+const char* const PROFILE_PHASE_NAMES[NumPhases] = {"eval", "activation", "dE_dZ", "dE_dX", "update", "dE_dX+update"};
+
+struct ProfileStat {
+    long long calls;
+    long long nanoseconds;
+    double flops;
+    double bytes;
+};
+
+struct ProfileEvent {
+    int layer;
+    int phase;
+    long long start;        // ns since the last reset
+    long long duration;
+    double flops;
+    double bytes;
+};
+
+
+class Profiler {
+public:
+    // Trace events kept per thread and epoch, the sums go on after that
+    static const int TRACE_LIMIT = 20000;
+
+    static Profiler& get() {
+        static Profiler profiler;
+        return profiler;
+    }
+
+    static long long now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void record(int layer, ProfilePhase phase, long long start, long long end, double flops, double bytes) {
+        Buffer& b = buffer();
+        if (layer >= (int)b.stats.size()) {
+            b.stats.resize(layer + 1, std::array<ProfileStat, NumPhases>{});
+        }
+        ProfileStat& s = b.stats[layer][phase];
+        s.calls++;
+        s.nanoseconds += end - start;
+        s.flops += flops;
+        s.bytes += bytes;
+        if (b.events.size() < TRACE_LIMIT) {
+            b.events.push_back(ProfileEvent{layer, (int)phase, start - origin, end - start, flops, bytes});
+        }
+    }
+
+    // Sums of every thread, stats[layer][phase]
+    std::vector<std::array<ProfileStat, NumPhases>> totals() {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::vector<std::array<ProfileStat, NumPhases>> sum;
+        for (Buffer& b : buffers) {
+            if (b.stats.size() > sum.size()) {
+                sum.resize(b.stats.size(), std::array<ProfileStat, NumPhases>{});
+            }
+            for (int L = 0; L < b.stats.size(); L++) {
+                for (int p = 0; p < NumPhases; p++) {
+                    sum[L][p].calls += b.stats[L][p].calls;
+                    sum[L][p].nanoseconds += b.stats[L][p].nanoseconds;
+                    sum[L][p].flops += b.stats[L][p].flops;
+                    sum[L][p].bytes += b.stats[L][p].bytes;
+                }
+            }
+        }
+        return sum;
+    }
+
+    // One line per layer and phase that ran. The times add up the threads,
+    // so with a pool they can exceed the wall time of the epoch.
+    void report(std::ostream& out) {
+        std::vector<std::array<ProfileStat, NumPhases>> sum = totals();
+        long long total = 0;
+        for (int L = 0; L < sum.size(); L++) {
+            for (int p = 0; p < NumPhases; p++) {
+                total += sum[L][p].nanoseconds;
+            }
+        }
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+        out << std::left << std::setw(7) << "Layer" << std::setw(14) << "Phase" << std::right << std::setw(10) << "Calls"
+            << std::setw(11) << "ms" << std::setw(8) << "%" << std::setw(10) << "GFLOP/s" << std::setw(9) << "GB/s" << std::endl;
+        out << std::fixed;
+        for (int L = 0; L < sum.size(); L++) {
+            for (int p = 0; p < NumPhases; p++) {
+                const ProfileStat& s = sum[L][p];
+                if (s.calls == 0) {
+                    continue;
+                }
+                double ns = (double)std::max(s.nanoseconds, 1LL);
+                out << std::left << std::setw(7) << L << std::setw(14) << PROFILE_PHASE_NAMES[p] << std::right << std::setw(10) << s.calls
+                    << std::setw(11) << std::setprecision(1) << s.nanoseconds * 1e-6
+                    << std::setw(8) << std::setprecision(1) << 100.0 * s.nanoseconds / std::max(total, 1LL)
+                    << std::setw(10) << std::setprecision(2) << s.flops / ns
+                    << std::setw(9) << std::setprecision(2) << s.bytes / ns << std::endl;
+            }
+        }
+        out << std::left << std::setw(31) << "Total" << std::right << std::setw(11) << std::setprecision(1) << total * 1e-6 << std::endl;
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+    // Chrome trace format: one complete ("X") event per recorded scope,
+    // a track per thread, and the summary of report() under "summary"
+    bool writeTrace(const std::string& filename) {
+        std::ofstream file(filename);
+        if (!file) {
+            std::cerr << "Unable to write file " << filename << std::endl;
+            return false;
+        }
+        std::vector<std::array<ProfileStat, NumPhases>> sum = totals();
+        std::lock_guard<std::mutex> lock(mtx);
+        file << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        bool first = true;
+        for (Buffer& b : buffers) {
+            for (const ProfileEvent& e : b.events) {
+                file << (first ? "\n" : ",\n") << "{\"name\":\"L" << e.layer << " " << PROFILE_PHASE_NAMES[e.phase] << "\",\"cat\":\""
+                     << PROFILE_PHASE_NAMES[e.phase] << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << b.tid
+                     << ",\"ts\":" << e.start * 1e-3 << ",\"dur\":" << e.duration * 1e-3
+                     << ",\"args\":{\"flops\":" << (long long)e.flops << ",\"bytes\":" << (long long)e.bytes << "}}";
+                first = false;
+            }
+        }
+        file << "\n],\"summary\":[";
+        first = true;
+        for (int L = 0; L < sum.size(); L++) {
+            for (int p = 0; p < NumPhases; p++) {
+                const ProfileStat& s = sum[L][p];
+                if (s.calls == 0) {
+                    continue;
+                }
+                file << (first ? "\n" : ",\n") << "{\"layer\":" << L << ",\"phase\":\"" << PROFILE_PHASE_NAMES[p] << "\",\"calls\":" << s.calls
+                     << ",\"ns\":" << s.nanoseconds << ",\"flops\":" << (long long)s.flops << ",\"bytes\":" << (long long)s.bytes << "}";
+                first = false;
+            }
+        }
+        file << "\n]}\n";
+        return (bool)file;
+    }
+
+    // Starts a new epoch, the buffers keep their capacity
+    void reset() {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (Buffer& b : buffers) {
+            for (std::array<ProfileStat, NumPhases>& layerStats : b.stats) {
+                layerStats.fill(ProfileStat{});
+            }
+            b.events.clear();
+        }
+        origin = now();
+    }
+
+private:
+    struct Buffer {
+        int tid;
+        std::vector<std::array<ProfileStat, NumPhases>> stats;
+        std::vector<ProfileEvent> events;
+    };
+
+    Profiler() {
+        origin = now();
+    }
+
+    // Created on the first record of each thread, only that thread writes it
+    Buffer& buffer() {
+        thread_local Buffer* local = nullptr;
+        if (local == nullptr) {
+            std::lock_guard<std::mutex> lock(mtx);
+            buffers.emplace_back();
+            local = &buffers.back();
+            local->tid = (int)buffers.size() - 1;
+            local->events.reserve(TRACE_LIMIT);
+        }
+        return *local;
+    }
+
+    std::mutex mtx;
+    std::deque<Buffer> buffers;     // a deque keeps the buffers in place as it grows
+    long long origin;
+};
+
+
+// Records the time from its construction to the end of the enclosing block
+class ProfileScope {
+public:
+    ProfileScope(int layer, ProfilePhase phase, double flops, double bytes)
+        : layer(layer), phase(phase), flops(flops), bytes(bytes), start(Profiler::now()) {}
+
+    ~ProfileScope() {
+        Profiler::get().record(layer, phase, start, Profiler::now(), flops, bytes);
+    }
+
+private:
+    int layer;
+    ProfilePhase phase;
+    double flops;
+    double bytes;
+    long long start;
+};
+
+#define ANN_PROFILE_JOIN2(a, b) a##b
+#define ANN_PROFILE_JOIN(a, b) ANN_PROFILE_JOIN2(a, b)
+#define ANN_PROFILE_SCOPE(layer, phase, flops, bytes) ProfileScope ANN_PROFILE_JOIN(profileScope, __LINE__)(layer, phase, flops, bytes)
+
+#else
+
+#define ANN_PROFILE_SCOPE(layer, phase, flops, bytes)
+
+#endif /* ANN_PROFILE */
+
+#endif /* Profiler_h */
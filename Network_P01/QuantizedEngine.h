@@ -0,0 +1,159 @@
+//
+//  QuantizedEngine.h
+//  Mnist_Multi_Layers
+//
+//  Int8 copy of an InferenceEngine. Every row of W gets its own scale
+//  s = max|w| / 127 and is stored as round(w / s). The input of each
+//  layer is quantized the same way with one scale per call, the dot
+//  products are exact in 32 bit integers and Z = s * sx * dot + bias is
+//  formed in float just before the activation. The weights take a
+//  quarter of the float memory.
+//
+
+#ifndef QuantizedEngine_h
+#define QuantizedEngine_h
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include "Activation.h"
+#include "Kernels.h"
+#include "Layer.h"
+#include "InferenceEngine.h"
+
+
+typedef std::vector<int8_t, AlignedAllocator<int8_t>> AlignedBytes;
+
+// Buffers of one predict caller
+struct QuantizedState {
+    std::vector<float> front;   // hidden layers alternate between front and back
+    std::vector<float> back;
+    std::vector<float> output;
+    AlignedBytes input;         // quantized input of the current layer
+};
+
+
+template <typename Activation = AFunction>
+class QuantizedEngineT {
+public:
+    QuantizedEngineT(const InferenceEngineT<Activation>& engine) {
+        activeFunction = engine.getActivation();
+        layer.resize(engine.numLayers());
+        size_t total = 0;
+        size_t totalParams = 0;
+        maxWidth = 0;
+        maxStride = 0;
+        for (int L = 0; L < layer.size(); L++) {
+            const typename InferenceEngineT<Activation>::PackedLayer& p = engine.packedLayer(L);
+            layer[L].nx = p.nx;
+            layer[L].ny = p.ny;
+            layer[L].stride = (p.nx + 63) & ~63;
+            layer[L].offset = total;
+            layer[L].paramOffset = totalParams;
+            total += (size_t)layer[L].ny * layer[L].stride;
+            totalParams += 2 * (size_t)((p.ny + 15) & ~15);
+            maxWidth = std::max(maxWidth, p.ny);
+            maxStride = std::max(maxStride, layer[L].stride);
+        }
+
+        weights.assign(total, 0);
+        params.assign(totalParams, 0.0f);
+        std::vector<float> row;
+        for (int L = 0; L < layer.size(); L++) {
+            const QuantizedLayer& q = layer[L];
+            const float* bias = engine.packedBias(L);
+            float* scale = params.data() + q.paramOffset;
+            float* qbias = scale + ((q.ny + 15) & ~15);
+            row.resize(q.nx);
+            for (int n = 0; n < q.ny; ++n) {
+                engine.rowWeights(L, n, row.data());
+                scale[n] = quantize(row.data(), q.nx, weights.data() + q.offset + (size_t)n * q.stride);
+                qbias[n] = bias[n];
+            }
+        }
+    }
+
+    QuantizedState createState() const {
+        QuantizedState state;
+        state.front.resize(maxWidth);
+        state.back.resize(maxWidth);
+        state.output.resize(layer.back().ny);
+        state.input.resize(maxStride);
+        return state;
+    }
+
+    // Outputs of the last layer, valid until the next call with the same state
+    const std::vector<float>& predict(const std::vector<float>& input, QuantizedState& state) const {
+        const float* x = input.data();
+        for (int L = 0; L < layer.size(); L++) {
+            float* y;
+            if (L == (int)layer.size() - 1) {
+                y = state.output.data();
+            } else {
+                y = (L % 2 == 0) ? state.front.data() : state.back.data();
+            }
+            evalLayer(layer[L], x, y, state.input.data());
+            x = y;
+        }
+        return state.output;
+    }
+
+    int classify(const std::vector<float>& input, QuantizedState& state) const {
+        const std::vector<float>& output = predict(input, state);
+        return (int)std::distance(output.begin(), std::max_element(output.begin(), output.end()));
+    }
+
+    int numInputs() const {
+        return layer[0].nx;
+    }
+
+private:
+    struct QuantizedLayer {
+        int nx;
+        int ny;
+        int stride;             // bytes per row, a multiple of 64
+        size_t offset;          // of the rows in weights
+        size_t paramOffset;     // of the row scales in params, the bias follows them
+    };
+
+    // Writes round(v / s) to q with s = max|v| / 127 and returns s
+    static float quantize(const float* v, int n, int8_t* q) {
+        const Kernels& k = Kernels::get();
+        float amax = k.absMax(v, n);
+        float s = (amax > 0.0f) ? amax / 127.0f : 1.0f;
+        k.quantizeI8(v, 1.0f / s, q, n);
+        return s;
+    }
+
+    // Same grouping as InferenceEngine, the integer sums of 16 nodes are
+    // scaled back to float and activated while they are in L1
+    void evalLayer(const QuantizedLayer& p, const float* x, float* y, int8_t* xq) const {
+        const Kernels& k = Kernels::get();
+        const int8_t* W = weights.data() + p.offset;
+        const float* scale = params.data() + p.paramOffset;
+        const float* bias = scale + ((p.ny + 15) & ~15);
+        float sx = quantize(x, p.nx, xq);
+        int32_t dot[16];
+        for (int n0 = 0; n0 < p.ny; n0 += 16) {
+            int n1 = std::min(n0 + 16, p.ny);
+            k.matvecI8(n1 - n0, p.nx, W + (size_t)n0 * p.stride, p.stride, xq, dot);
+            for (int n = n0; n < n1; ++n) {
+                y[n] = (float)dot[n - n0] * (scale[n] * sx) + bias[n];
+            }
+            activeFunction->evalSpan(y + n0, y + n0, n1 - n0);
+        }
+    }
+
+    std::vector<QuantizedLayer> layer;
+    AlignedBytes weights;
+    AlignedVector params;
+    int maxWidth;
+    int maxStride;
+    Activation* activeFunction;
+};
+
+typedef QuantizedEngineT<AFunction> QuantizedEngine;
+
+
+#endif /* QuantizedEngine_h */
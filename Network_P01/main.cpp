@@ -8,88 +8,247 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <string>
+#include <type_traits>
 #include "readFiles.h"
+#include "DataPipeline.h"
 #include "NeuralNetwork.h"
+#include "InferenceEngine.h"
+#include "QuantizedEngine.h"
+#include "CheckpointWriter.h"
+#include "AllocationCounter.h"
+#include "Profiler.h"
 
 
-std::vector<float> one_hot_encode(int label, int num_classes) {
-    std::vector<float> encoded(num_classes, 0.1);
+// The network is built on the concrete activation class, so eval and
+// derivative are inlined. -DANN_VIRTUAL builds the same network on
+// AFunction, with a virtual call per node, to compare the two
+#ifdef ANN_VIRTUAL
+typedef AFunction NetActivation;
+#else
+typedef TriangleWave NetActivation;
+#endif
+
+
+// Writes into encoded, which keeps its capacity between calls
+void one_hot_encode(int label, int num_classes, std::vector<float>& encoded) {
+    encoded.assign(num_classes, 0.1);
     encoded[label] = 0.9;
-    return encoded;
 }
 
-void testSamples(float num_images, std::vector<std::vector<float>>& images, std::vector<int>& labels, NeuralNetwork& nn) {
+// The test set is split in fixed chunks that the pool threads take in
+// turn. Each chunk keeps its own sums and they are added in chunk order,
+// so the result does not depend on the number of threads. Returns the accuracy.
+template <typename Engine>
+float testSamples(float num_images, const MnistImages& images, const MnistLabels& labels, const Engine& engine, ThreadPool* pool, const char* title = "Test 10k") {
     
-    float total_loss = 0.0;
-    int correct_predictions = 0;
+    const int chunk = 250;
+    int count = (int)num_images;
+    int num_chunks = (count + chunk - 1) / chunk;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<double> chunk_loss(num_chunks, 0.0);
+    std::vector<int> chunk_correct(num_chunks, 0);
+    std::atomic<int> next_chunk(0);
 
-    for (int i = 0; i < num_images; ++i) {
-        std::vector<float> output = nn.forward(images[i]);
-        std::vector<float> target = one_hot_encode(labels[i], 10);
+    auto evaluate = [&](int tid, int nthreads) {
+        auto state = engine.createState();
+        std::vector<float> input(images.imageSize());
+        std::vector<float> target;
+        for (int c = next_chunk++; c < num_chunks; c = next_chunk++) {
+            int end = std::min(count, (c + 1) * chunk);
+            for (int i = c * chunk; i < end; ++i) {
+                images.normalize(i, input);
+                const std::vector<float>& output = engine.predict(input, state);
+                one_hot_encode(labels[i], 10, target);
 
-        int predicted_label = (int) std::distance(output.begin(), std::max_element(output.begin(), output.end()));
-        if (predicted_label == labels[i]) {
-            correct_predictions++;
-        }
+                int predicted_label = (int) std::distance(output.begin(), std::max_element(output.begin(), output.end()));
+                if (predicted_label == labels[i]) {
+                    chunk_correct[c]++;
+                }
 
-        for (int k = 0; k < 10; ++k) {
-            total_loss += 0.5 * (target[k] - output[k]) * (target[k] - output[k]);
+                for (int k = 0; k < 10; ++k) {
+                    chunk_loss[c] += 0.5 * (target[k] - output[k]) * (target[k] - output[k]);
+                }
+            }
         }
+    };
+    if (pool != nullptr) {
+        pool->run(evaluate);
+    } else {
+        evaluate(0, 1);
     }
 
-    std::cout << std::endl << "Test 10k" << " - Loss: " << total_loss / num_images << " - Accuracy: " << static_cast<float>(correct_predictions) / num_images << std::endl;
-    
+    double total_loss = 0.0;
+    int correct_predictions = 0;
+    for (int c = 0; c < num_chunks; ++c) {
+        total_loss += chunk_loss[c];
+        correct_predictions += chunk_correct[c];
+    }
+
+    float accuracy = static_cast<float>(correct_predictions) / num_images;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << std::endl << title << " - Loss: " << total_loss / num_images << " - Accuracy: " << accuracy << " - Images/s: " << num_images / seconds << std::endl;
+    return accuracy;
+}
+
+// Tests the float engine and its int8 copy, and prints what quantization costs
+template <typename Activation>
+void testQuantized(float num_images, const MnistImages& images, const MnistLabels& labels, const InferenceEngineT<Activation>& engine, ThreadPool* pool) {
+    float accuracy = testSamples(num_images, images, labels, engine, pool);
+    float quantized = testSamples(num_images, images, labels, QuantizedEngineT<Activation>(engine), pool, "Test 10k int8");
+    std::cout << "Int8 accuracy delta: " << quantized - accuracy << std::endl;
 }
 
 int main(int argc, const char * argv[]) {
-    int num_images, image_size, num_labels;
-    int t10k_num_images, t10k_image_size, t10k_num_labels;
+    MnistImages train_images("train-images.idx3-ubyte");
+    MnistLabels train_labels("train-labels.idx1-ubyte");
 
-    std::vector<std::vector<float>> train_images = read_mnist_images("train-images.idx3-ubyte", num_images, image_size);
-    std::vector<int> train_labels = read_mnist_labels("train-labels.idx1-ubyte", num_labels);
+    MnistImages t10k_images("t10k-images.idx3-ubyte");
+    MnistImages t10k_inv_images("t10k-images.idx3-ubyte", true);
+    MnistLabels t10k_labels("t10k-labels.idx1-ubyte");
 
-    std::vector<std::vector<float>> t10k_images = read_mnist_images("t10k-images.idx3-ubyte", t10k_num_images, t10k_image_size);
-    std::vector<std::vector<float>> t10k_inv_images = read_mnist_images("t10k-images.idx3-ubyte", t10k_num_images, t10k_image_size, true);
-    std::vector<int> t10k_labels = read_mnist_labels("t10k-labels.idx1-ubyte", t10k_num_labels);
+    int num_images = train_images.size();
+    int image_size = train_images.imageSize();
+    int t10k_num_images = t10k_images.size();
     
     TriangleWave activation;
     
-    NeuralNetwork nn( image_size, { 128, 10 }, &activation);
+    NeuralNetworkT<NetActivation> nn( image_size, { 128, 10 }, &activation);
     
+    // One thread unless ANN_THREADS asks for more (0 for every hardware thread)
+    int threads = ThreadPool::requestedThreads();
+    nn.setThreads(threads);
+
+    // Weights of the test engines, BFloat16 or Float16 halve the bytes read per image
+    WeightStorage test_storage = Float32;
+
+    // "weights.ann sweep" prunes the saved model to a growing sparsity and
+    // tests every step, which gives the speed / accuracy curve of pruning
+    if (argc > 2 && std::string(argv[2]) == "sweep") {
+        for (float sparsity : {0.0f, 0.5f, 0.7f, 0.8f, 0.9f, 0.95f, 0.98f}) {
+            if (!nn.loadWeights(argv[1])) {
+                return 1;
+            }
+            if (sparsity > 0.0f) {
+                nn.prune(sparsity);
+            }
+            std::string title = "Sparsity " + std::to_string(sparsity);
+            testSamples(t10k_num_images, t10k_images, t10k_labels, InferenceEngineT<NetActivation>(nn), nn.getPool(), title.c_str());
+        }
+        return 0;
+    }
+    // With a checkpoint argument only the saved model is tested
+    if (argc > 1) {
+        testQuantized(t10k_num_images, t10k_images, t10k_labels, InferenceEngineT<NetActivation>(argv[1], &activation, test_storage), nn.getPool());
+        return 0;
+    }
+    // Hogwild: every thread trains its own shard on the shared weights,
+    // otherwise the threads split each layer of the serial loop
+    bool hogwild = false;
+
     int epochs = 20;
     float learning_rate = activation.learnRate;
+    // Fast evaluates the activations with the polynomial kernels (error < 1.2e-7)
+    activation.precision = AFunction::Fast;
+
+    std::cout << "Kernels: " << Kernels::get().name() << " - Activations: " << (activation.precision == AFunction::Fast ? "fast" : "exact") << " - Dispatch: " << (std::is_same<NetActivation, AFunction>::value ? "virtual" : "template") << " - Threads: " << threads << (hogwild ? " (hogwild)" : "") << std::endl;
+
+    // Shuffled, normalized samples with their targets, prepared on a background thread
+    DataPipeline pipeline(train_images, train_labels, 10, 0.1f, 0.9f);
+
+    // The first layer keeps the background pixels as a per-node bias and
+    // only reads and updates the weights of the foreground pixels
+    nn.setInputBackground(train_images.background());
+
+    // A background thread writes weights.ann every checkpoint_epochs epochs
+    // and, when checkpoint_samples > 0, every checkpoint_samples samples
+    int checkpoint_epochs = 1;
+    int checkpoint_samples = 0;
+    CheckpointWriter checkpoint("weights.ann");
+
+    // With prune_sparsity > 0 every node keeps its largest (1 - prune_sparsity)
+    // weights after prune_epoch epochs, the remaining epochs fine-tune them
+    float prune_sparsity = 0.0f;
+    int prune_epoch = 15;
 
     for (int epoch = 0; epoch < epochs; ++epoch) {
+        if (prune_sparsity > 0.0f && epoch == prune_epoch) {
+            std::cout << "Pruned " << nn.prune(prune_sparsity) * 100.0f << "% of the weights" << std::endl;
+        }
+        auto epoch_start = std::chrono::steady_clock::now();
         float total_loss = 0.0;
         int correct_predictions = 0;
+#ifdef ANN_PROFILE
+        Profiler::get().reset();
+#endif
+#ifdef ANN_CHECK_ALLOCATIONS
+        long long allocations = allocationCount().load();
+#endif
 
-        for (int i = 0; i < num_images; ++i) {
-            std::vector<float> output = nn.forward(train_images[i]);
-            std::vector<float> target = one_hot_encode(train_labels[i], 10);
+        if (hogwild) {
+            TrainStats stats = nn.trainHogwild(num_images, learning_rate, [&](int i, std::vector<float>& input, std::vector<float>& target) {
+                train_images.normalize(i, input);
+                one_hot_encode(train_labels[i], 10, target);
+            });
+            total_loss = stats.loss;
+            correct_predictions = stats.correct;
+        } else {
+            for (int i = 0; i < num_images; ++i) {
+                const Sample& sample = pipeline.next();
+                const std::vector<float>& target = sample.target;
+                const std::vector<float>& output = nn.forward(sample.input, sample.foreground);
 
-            nn.backward(train_images[i], target, learning_rate);
+                nn.backward(sample.input, sample.foreground, target, learning_rate);
+                if (checkpoint_samples > 0 && (i + 1) % checkpoint_samples == 0) {
+                    checkpoint.submit(nn);
+                }
 
-            int predicted_label = (int ) std::distance(output.begin(), std::max_element(output.begin(), output.end()));
-            if (predicted_label == train_labels[i]) {
-                correct_predictions++;
-            }
-            
-            for (int k = 0; k < 10; ++k) {
-                total_loss += 0.5 * (target[k] - output[k]) * (target[k] - output[k]);
+                int predicted_label = (int ) std::distance(output.begin(), std::max_element(output.begin(), output.end()));
+                if (predicted_label == sample.label) {
+                    correct_predictions++;
+                }
+                
+                for (int k = 0; k < 10; ++k) {
+                    total_loss += 0.5 * (target[k] - output[k]) * (target[k] - output[k]);
+                }
             }
         }
+
+#ifdef ANN_CHECK_ALLOCATIONS
+        // Everything is sized during the first epoch, later ones must not allocate
+        allocations = allocationCount().load() - allocations;
+        if (epoch > 0 && allocations != 0) {
+            std::cerr << "Epoch " << epoch + 1 << " made " << allocations << " heap allocations" << std::endl;
+            exit(1);
+        }
+#endif
     
 //        nn.printGradients();
-        std::cout << "Epoch " << epoch + 1 << "/" << epochs << " - Loss: " << total_loss / num_images << " - Accuracy: " << static_cast<float>(correct_predictions) / num_images << std::endl;
+        double epoch_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - epoch_start).count();
+        std::cout << "Epoch " << epoch + 1 << "/" << epochs << " - Loss: " << total_loss / num_images << " - Accuracy: " << static_cast<float>(correct_predictions) / num_images << " - Images/s: " << num_images / epoch_seconds << std::endl;
+#ifdef ANN_PROFILE
+        // Time, FLOPs and bytes of every layer and phase, the trace opens in chrome://tracing
+        Profiler::get().report(std::cout);
+        Profiler::get().writeTrace("profile_epoch" + std::to_string(epoch + 1) + ".json");
+#endif
         
+        if ((epoch + 1) % checkpoint_epochs == 0) {
+            checkpoint.submit(nn);
+        }
+
         if(((epoch + 1) % 10) == 0) {
-            testSamples(t10k_num_images, t10k_images, t10k_labels, nn);
+            testSamples(t10k_num_images, t10k_images, t10k_labels, InferenceEngineT<NetActivation>(nn, test_storage), nn.getPool());
         }
         
     }
     
-    nn.saveWeights("test.txt");
-    testSamples(t10k_num_images, t10k_images, t10k_labels, nn);
+    checkpoint.submit(nn);
+    checkpoint.wait();
+//    nn.dumpWeights("test.txt");
+    testQuantized(t10k_num_images, t10k_images, t10k_labels, InferenceEngineT<NetActivation>(nn, test_storage), nn.getPool());
     
     
 
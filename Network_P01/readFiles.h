@@ -12,73 +12,164 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <string>
 #include <cstdint>
+#include <cstdlib>
+#include "MappedFile.h"
 
-std::vector<std::vector<float>> read_mnist_images(const std::string &path, int &num_images, int &image_size, bool inverse = false) {
-    std::ifstream file(path, std::ios::binary);
-    if (file.is_open()) {
-        int32_t magic_number = 0;
-        int32_t n_images = 0;
-        int32_t n_rows = 0;
-        int32_t n_cols = 0;
-
-        file.read(reinterpret_cast<char*>(&magic_number), 4);
-        file.read(reinterpret_cast<char*>(&n_images), 4);
-        file.read(reinterpret_cast<char*>(&n_rows), 4);
-        file.read(reinterpret_cast<char*>(&n_cols), 4);
-
-        magic_number = __builtin_bswap32(magic_number);
-        n_images = __builtin_bswap32(n_images);
-        n_rows = __builtin_bswap32(n_rows);
-        n_cols = __builtin_bswap32(n_cols);
-
-        num_images = n_images;
+const int32_t IDX_IMAGES_MAGIC = 0x00000803;  // unsigned byte, 3 dimensions
+const int32_t IDX_LABELS_MAGIC = 0x00000801;  // unsigned byte, 1 dimension
+
+
+inline int32_t read_idx_int(const uint8_t* ptr) {
+    return (int32_t)(((uint32_t)ptr[0] << 24) | ((uint32_t)ptr[1] << 16) | ((uint32_t)ptr[2] << 8) | (uint32_t)ptr[3]);
+}
+
+/* *************************************************************** */
+/* MNIST images kept as the mapped uint8 pixels of the IDX file, they
+   are converted to the network input range only when used */
+class MnistImages {
+public:
+    MnistImages(const std::string &path, bool inverse = false) {
+        if (!file.open(path)) {
+            std::cerr << "Unable to open file " << path << std::endl;
+            exit(1);
+        }
+        int32_t magic_number = (file.length >= 16) ? read_idx_int(file.data) : 0;
+        if (magic_number != IDX_IMAGES_MAGIC) {
+            std::cerr << "Invalid IDX image file " << path << " (magic number " << magic_number << ")" << std::endl;
+            exit(1);
+        }
+        num_images = read_idx_int(file.data + 4);
+        int32_t n_rows = read_idx_int(file.data + 8);
+        int32_t n_cols = read_idx_int(file.data + 12);
         image_size = n_rows * n_cols;
-//        image_size = exp2((int)(log2(n_rows * n_cols) + 1));
-        std::vector<std::vector<float>> images(n_images, std::vector<float>(image_size, 0.1f));
-        for (int i = 0; i < n_images; ++i) {
-            for (int j = 0; j < n_rows * n_cols; ++j) {
-                unsigned char temp = 0;
-                file.read(reinterpret_cast<char*>(&temp), 1);
-                if (inverse) {
-                    images[i][j] = (1.0 - (static_cast<float>(temp) / 255.0)) * 0.8 + 0.1;
-                } else {
-                    images[i][j] = (static_cast<float>(temp) / 255.0) * 0.8 + 0.1;
-                }
+        if (num_images < 0 || image_size <= 0 || file.length < 16 + (size_t)num_images * image_size) {
+            std::cerr << "Truncated IDX image file " << path << std::endl;
+            exit(1);
+        }
+        pixels = file.data + 16;
+        backgroundPixel = inverse ? 255 : 0;
+
+        for (int v = 0; v < 256; ++v) {
+            if (inverse) {
+                lut[v] = (1.0 - (static_cast<float>(v) / 255.0)) * 0.8 + 0.1;
+            } else {
+                lut[v] = (static_cast<float>(v) / 255.0) * 0.8 + 0.1;
             }
         }
-        return images;
-    } else {
-        std::cerr << "Unable to open file " << path << std::endl;
-        exit(1);
     }
-}
 
-std::vector<int> read_mnist_labels(const std::string &path, int &num_labels) {
-    std::ifstream file(path, std::ios::binary);
-    if (file.is_open()) {
-        int32_t magic_number = 0;
-        int32_t n_labels = 0;
+    int size() const {
+        return num_images;
+    }
+
+    int imageSize() const {
+        return image_size;
+    }
+
+    const uint8_t* image(int i) const {
+        return pixels + (size_t)i * image_size;
+    }
 
-        file.read(reinterpret_cast<char*>(&magic_number), 4);
-        file.read(reinterpret_cast<char*>(&n_labels), 4);
+    // Writes the normalized pixels of image i to dst[0 .. imageSize)
+    void normalize(int i, float* dst) const {
+        const uint8_t* src = image(i);
+        for (int j = 0; j < image_size; ++j) {
+            dst[j] = lut[src[j]];
+        }
+    }
 
-        magic_number = __builtin_bswap32(magic_number);
-        n_labels = __builtin_bswap32(n_labels);
+    void normalize(int i, std::vector<float> &dst) const {
+        dst.resize(image_size);
+        normalize(i, dst.data());
+    }
 
-        num_labels = n_labels;
+    // Normalized value of the background pixels, most of every image
+    float background() const {
+        return lut[backgroundPixel];
+    }
 
-        std::vector<int> labels(n_labels);
-        for (int i = 0; i < n_labels; ++i) {
-            unsigned char temp = 0;
-            file.read(reinterpret_cast<char*>(&temp), 1);
-            labels[i] = static_cast<int>(temp);
+    // Indices of the pixels of image i that are not background, in order.
+    // index keeps its capacity, so a buffer of imageSize never reallocates.
+    void foreground(int i, std::vector<int> &index) const {
+        const uint8_t* src = image(i);
+        index.resize(image_size);
+        int count = 0;
+        for (int j = 0; j < image_size; ++j) {
+            if (src[j] != backgroundPixel) {
+                index[count++] = j;
+            }
         }
-        return labels;
-    } else {
-        std::cerr << "Unable to open file " << path << std::endl;
-        exit(1);
+        index.resize(count);
+    }
+
+    float lut[256];
+
+private:
+    MappedFile file;
+    const uint8_t* pixels;
+    uint8_t backgroundPixel;    // 0, or 255 for the inverse images
+    int num_images;
+    int image_size;
+};
+
+class MnistLabels {
+public:
+    MnistLabels(const std::string &path) {
+        if (!file.open(path)) {
+            std::cerr << "Unable to open file " << path << std::endl;
+            exit(1);
+        }
+        int32_t magic_number = (file.length >= 8) ? read_idx_int(file.data) : 0;
+        if (magic_number != IDX_LABELS_MAGIC) {
+            std::cerr << "Invalid IDX label file " << path << " (magic number " << magic_number << ")" << std::endl;
+            exit(1);
+        }
+        num_labels = read_idx_int(file.data + 4);
+        if (num_labels < 0 || file.length < 8 + (size_t)num_labels) {
+            std::cerr << "Truncated IDX label file " << path << std::endl;
+            exit(1);
+        }
+        labels = file.data + 8;
+    }
+
+    int size() const {
+        return num_labels;
+    }
+
+    int operator[](int i) const {
+        return static_cast<int>(labels[i]);
+    }
+
+private:
+    MappedFile file;
+    const uint8_t* labels;
+    int num_labels;
+};
+
+
+/* *************************************************************** */
+/* Fully expanded copies, kept for code that wants plain vectors */
+std::vector<std::vector<float>> read_mnist_images(const std::string &path, int &num_images, int &image_size, bool inverse = false) {
+    MnistImages mapped(path, inverse);
+    num_images = mapped.size();
+    image_size = mapped.imageSize();
+    std::vector<std::vector<float>> images(num_images);
+    for (int i = 0; i < num_images; ++i) {
+        mapped.normalize(i, images[i]);
+    }
+    return images;
+}
+
+std::vector<int> read_mnist_labels(const std::string &path, int &num_labels) {
+    MnistLabels mapped(path);
+    num_labels = mapped.size();
+    std::vector<int> labels(num_labels);
+    for (int i = 0; i < num_labels; ++i) {
+        labels[i] = mapped[i];
     }
+    return labels;
 }
 
 
@@ -0,0 +1,61 @@
+//
+//  AllocationCounter.h
+//  Mnist_Multi_Layers
+//
+//  Counts calls to the global operator new when built with
+//  -DANN_CHECK_ALLOCATIONS, so main can verify that a training epoch
+//  runs without heap allocations once the buffers are warmed up.
+//  Buffers from AlignedAllocator use aligned_alloc and are not counted,
+//  they are only created with the layers. Without the flag this header
+//  is empty.
+//
+
+#ifndef AllocationCounter_h
+#define AllocationCounter_h
+
+#ifdef ANN_CHECK_ALLOCATIONS
+
+#include <atomic>
+#include <new>
+#include <cstdlib>
+
+
+inline std::atomic<long long>& allocationCount() {
+    static std::atomic<long long> count(0);
+    return count;
+}
+
+// new and delete are kept out of line, so the compiler pairs them with
+// each other instead of seeing free() called on what operator new returned
+__attribute__((noinline)) void* operator new(std::size_t size) {
+    allocationCount().fetch_add(1, std::memory_order_relaxed);
+    void* ptr = std::malloc(size ? size : 1);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    operator delete(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    operator delete(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+    operator delete(ptr);
+}
+
+#endif /* ANN_CHECK_ALLOCATIONS */
+
+#endif /* AllocationCounter_h */
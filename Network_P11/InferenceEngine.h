@@ -0,0 +1,285 @@
+//
+//  InferenceEngine.h
+//  Mnist_Multi_Layers
+//
+//  Read-only forward pass for a trained network. The weights are copied
+//  once into a packed block (w_constant's alpha is folded into W and the
+//  bias), pre-activations and gradients are never kept, and predict is
+//  const, so many threads can call it at once, each with its own
+//  InferenceState. W can be kept in bfloat16 or IEEE half to halve the
+//  bytes read per prediction; the products are still done in float.
+//  Float32 layers that were pruned to at most INFERENCE_SPARSE_DENSITY
+//  non-zero weights are kept in CSR form.
+//
+
+#ifndef InferenceEngine_h
+#define InferenceEngine_h
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include "Activation.h"
+#include "Kernels.h"
+#include "Layer.h"
+#include "MappedFile.h"
+#include "Checkpoint.h"
+#include "NeuralNetwork.h"
+
+
+// Below this fraction of non-zero weights the sparse product beats the
+// dense one on both AVX2 and AVX-512, for 784 and 1024 wide layers
+const float INFERENCE_SPARSE_DENSITY = 0.25f;
+
+// Buffers of one predict caller
+struct InferenceState {
+    std::vector<float> front;   // hidden layers alternate between front and back
+    std::vector<float> back;
+    std::vector<float> output;
+};
+
+
+template <typename Activation = AFunction>
+class InferenceEngineT {
+public:
+    // Freezes the current weights of nn
+    InferenceEngineT(NeuralNetworkT<Activation>& nn, WeightStorage storage = Float32) {
+        this->storage = storage;
+        activeFunction = nn.getActivation();
+        std::vector<char> image;
+        nn.snapshotWeights(image);
+        load(reinterpret_cast<const uint8_t*>(image.data()), image.size(), "network snapshot");
+    }
+
+    // Reads a checkpoint written by NeuralNetwork::saveWeights
+    InferenceEngineT(const std::string& filename, Activation* activeFunction, WeightStorage storage = Float32) {
+        this->storage = storage;
+        this->activeFunction = activeFunction;
+        MappedFile file;
+        if (!file.open(filename)) {
+            std::cerr << "Unable to open file " << filename << std::endl;
+            exit(1);
+        }
+        load(file.data, file.length, filename);
+    }
+
+    InferenceState createState() const {
+        InferenceState state;
+        state.front.resize(maxWidth);
+        state.back.resize(maxWidth);
+        state.output.resize(layer.back().ny);
+        return state;
+    }
+
+    // Outputs of the last layer, valid until the next call with the same state
+    const std::vector<float>& predict(const std::vector<float>& input, InferenceState& state) const {
+        const float* x = input.data();
+        for (int L = 0; L < layer.size(); L++) {
+            float* y;
+            if (L == (int)layer.size() - 1) {
+                y = state.output.data();
+            } else {
+                y = (L % 2 == 0) ? state.front.data() : state.back.data();
+            }
+            evalLayer(layer[L], x, y);
+            x = y;
+        }
+        return state.output;
+    }
+
+    int classify(const std::vector<float>& input, InferenceState& state) const {
+        const std::vector<float>& output = predict(input, state);
+        return (int)std::distance(output.begin(), std::max_element(output.begin(), output.end()));
+    }
+
+    int numInputs() const {
+        return layer[0].nx;
+    }
+
+    struct PackedLayer {
+        int nx;
+        int ny;
+        int stride;
+        size_t offset;          // of the rows in weights or halves
+        size_t bias;            // of the biases in bias
+        bool sparse;
+        size_t rowStart;        // of the CSR row starts in csrStart when sparse
+    };
+
+    int numLayers() const {
+        return (int)layer.size();
+    }
+
+    const PackedLayer& packedLayer(int L) const {
+        return layer[L];
+    }
+
+    WeightStorage getStorage() const {
+        return storage;
+    }
+
+    // Row n of layer L widened to float
+    void rowWeights(int L, int n, float* w) const {
+        const PackedLayer& p = layer[L];
+        if (p.sparse) {
+            std::fill(w, w + p.nx, 0.0f);
+            for (int j = csrStart[p.rowStart + n]; j < csrStart[p.rowStart + n + 1]; ++j) {
+                w[csrColumn[j]] = csrValues[j];
+            }
+            return;
+        }
+        size_t at = p.offset + (size_t)n * p.stride;
+        for (int i = 0; i < p.nx; ++i) {
+            switch (storage) {
+                case BFloat16: w[i] = bf16ToFloat(halves[at + i]); break;
+                case Float16: w[i] = halfToFloat(halves[at + i]); break;
+                default: w[i] = weights[at + i]; break;
+            }
+        }
+    }
+
+    const float* packedBias(int L) const {
+        return bias.data() + layer[L].bias;
+    }
+
+    Activation* getActivation() const {
+        return activeFunction;
+    }
+
+private:
+
+    // Nodes are done 16 at a time and the activation runs on each group
+    // while it is still in L1, so y is written once and Z is never stored
+    void evalLayer(const PackedLayer& p, const float* x, float* y) const {
+        const Kernels& k = Kernels::get();
+        const float* b = bias.data() + p.bias;
+        for (int n0 = 0; n0 < p.ny; n0 += 16) {
+            int n1 = std::min(n0 + 16, p.ny);
+            size_t rows = p.offset + (size_t)n0 * p.stride;
+            if (p.sparse) {
+                k.spmv(n1 - n0, csrStart.data() + p.rowStart + n0, csrColumn.data(), csrValues.data(), x, y + n0);
+            } else {
+                switch (storage) {
+                    case BFloat16: k.matvecBf16(n1 - n0, p.nx, halves.data() + rows, p.stride, x, y + n0); break;
+                    case Float16: k.matvecHalf(n1 - n0, p.nx, halves.data() + rows, p.stride, x, y + n0); break;
+                    default: k.matvec(n1 - n0, p.nx, weights.data() + rows, p.stride, x, y + n0); break;
+                }
+            }
+            for (int n = n0; n < n1; ++n) {
+                y[n] += b[n];
+            }
+            activeFunction->evalSpan(y + n0, y + n0, n1 - n0);
+        }
+    }
+
+    void load(const uint8_t* data, size_t size, const std::string& name) {
+        const char* error = checkpointError(data, size);
+        if (error != nullptr) {
+            std::cerr << error << " " << name << std::endl;
+            exit(1);
+        }
+        const CheckpointHeader* header = reinterpret_cast<const CheckpointHeader*>(data);
+        if (header->activation != (uint32_t)activeFunction->getType()) {
+            std::cerr << "Checkpoint " << name << " was trained with another activation" << std::endl;
+            exit(1);
+        }
+        const CheckpointLayer* table = reinterpret_cast<const CheckpointLayer*>(data + sizeof(CheckpointHeader));
+
+        size_t total = 0;
+        size_t totalBias = 0;
+        layer.resize(header->numLayers);
+        maxWidth = 0;
+        for (int L = 0; L < layer.size(); L++) {
+            PackedLayer& p = layer[L];
+            p.nx = (int)table[L].numInputs;
+            p.ny = (int)table[L].numOutputs;
+            p.stride = (int)table[L].stride;
+            p.offset = total;
+            p.bias = totalBias;
+            p.sparse = false;
+            p.rowStart = 0;
+            if (storage == Float32) {
+                const float* block = reinterpret_cast<const float*>(data + table[L].offset);
+                size_t nonZero = 0;
+                for (int n = 0; n < p.ny; ++n) {
+                    for (int i = 0; i < p.nx; ++i) {
+                        nonZero += (block[(size_t)n * p.stride + i] != 0.0f);
+                    }
+                }
+                p.sparse = nonZero <= INFERENCE_SPARSE_DENSITY * p.nx * p.ny;
+            }
+            if (!p.sparse) {
+                total += (size_t)p.ny * p.stride;
+            }
+            totalBias += (p.ny + 15) & ~15;
+            maxWidth = std::max(maxWidth, p.ny);
+        }
+
+        const Kernels& k = Kernels::get();
+        if (storage == Float32) {
+            weights.assign(total, 0.0f);
+        } else {
+            halves.assign(total, 0);
+        }
+        bias.assign(totalBias, 0.0f);
+        csrStart.clear();
+        csrColumn.clear();
+        csrValues.clear();
+        std::vector<float> row;
+        for (int L = 0; L < layer.size(); L++) {
+            PackedLayer& p = layer[L];
+            if (p.sparse) {
+                p.rowStart = csrStart.size();
+            }
+            const float* block = reinterpret_cast<const float*>(data + table[L].offset);
+            const float* params = block + (size_t)p.ny * p.stride;
+            size_t padded = (p.ny + 15) & ~15;
+            row.assign(p.stride, 0.0f);
+            for (int n = 0; n < p.ny; ++n) {
+                // Z = alpha * (beta + W x) for two per-node vectors, theta + W x for one
+                float scale = (header->nodeParams == 2) ? params[n] : 1.0f;
+                const float* src = block + (size_t)n * p.stride;
+                for (int i = 0; i < p.nx; ++i) {
+                    row[i] = scale * src[i];
+                }
+                size_t at = p.offset + (size_t)n * p.stride;
+                if (p.sparse) {
+                    csrStart.push_back((int)csrColumn.size());
+                    for (int i = 0; i < p.nx; ++i) {
+                        if (row[i] != 0.0f) {
+                            csrColumn.push_back(i);
+                            csrValues.push_back(row[i]);
+                        }
+                    }
+                } else {
+                    switch (storage) {
+                        case BFloat16: k.toBf16(row.data(), halves.data() + at, p.nx); break;
+                        case Float16: k.toHalf(row.data(), halves.data() + at, p.nx); break;
+                        default: std::copy(row.begin(), row.begin() + p.nx, weights.begin() + at); break;
+                    }
+                }
+                bias[p.bias + n] = (header->nodeParams == 2) ? params[n] * params[padded + n] : params[n];
+            }
+            if (p.sparse) {
+                csrStart.push_back((int)csrColumn.size());
+            }
+        }
+    }
+
+    std::vector<PackedLayer> layer;
+    WeightStorage storage;
+    AlignedVector weights;      // rows of Float32 engines
+    AlignedHalves halves;       // rows of BFloat16 and Float16 engines
+    AlignedVector bias;
+    std::vector<int> csrStart;  // rows of the sparse layers, ny + 1 entries each
+    std::vector<int> csrColumn;
+    AlignedVector csrValues;
+    int maxWidth;
+    Activation* activeFunction;
+};
+
+typedef InferenceEngineT<AFunction> InferenceEngine;
+
+
+#endif /* InferenceEngine_h */
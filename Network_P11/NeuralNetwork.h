@@ -8,57 +8,222 @@
 #ifndef NeuralNetwork_h
 #define NeuralNetwork_h
 
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
 #include <vector>
 #include <cmath>
 #include <random>
+#include <algorithm>
+#include <cstring>
 #include "Activation.h"
 #include "Layer.h"
+#include "ThreadPool.h"
+#include "MappedFile.h"
+#include "Checkpoint.h"
 
 
-class NeuralNetwork {
+// Activations of every layer, one per thread that runs the network
+typedef std::vector<LayerState> Workspace;
+
+struct TrainStats {
+    double loss;
+    int correct;
+};
+
+// Buffers of one hogwild thread, kept between epochs
+struct HogwildShard {
+    Workspace ws;
+    std::vector<float> input;
+    std::vector<float> target;
+    TrainStats stats;
+};
+
+
+// NeuralNetworkT<TriangleWave> etc. inline the activation in every layer,
+// NeuralNetwork keeps the virtual AFunction so it can be picked at run time
+template <typename Activation = AFunction>
+class NeuralNetworkT {
 public:
-    NeuralNetwork(int numOfInputs, const std::vector<int> layers, AFunction* activeFunction) {
+    typedef LayerT<Activation> Layer;
+
+    NeuralNetworkT(int numOfInputs, const std::vector<int> layers, Activation* activeFunction) {
         this->activeFunction = activeFunction;
+        this->pool = nullptr;
         
         layer.push_back(new Layer(numOfInputs, layers[0], activeFunction));
         for (int i = 1; i < layers.size(); i++) {
             layer.push_back(new Layer(layers[i - 1], layers[i], activeFunction));
         }
+        for (int L = 0; L < layer.size(); L++) {
+            layer[L]->index = L;
+        }
+        state = createWorkspace();
     }
 
-    std::vector<float> forward(const std::vector<float> &input) {
-        layer[0]->eval(input);
+    Workspace createWorkspace() const {
+        Workspace ws(layer.size());
+        for (int L = 0; L < layer.size(); L++) {
+            ws[L].resize((int)layer[L]->Nx, (int)layer[L]->Ny);
+        }
+        return ws;
+    }
+
+    // The returned outputs are overwritten by the next call
+    const std::vector<float>& forward(const std::vector<float> &input) {
+        return forward(input, state);
+    }
+
+    const std::vector<float>& forward(const std::vector<float> &input, Workspace &ws) {
+        layer[0]->eval(input, ws[0]);
         for (int L = 1; L < layer.size(); L++) {
-            layer[L]->eval(layer[L - 1]->Y);
+            layer[L]->eval(ws[L - 1].Y, ws[L]);
         }
         
-        return layer.back()->Y;
+        return ws.back().Y;
     }
 
     void backward(const std::vector<float> &input, const std::vector<float> &target, float learningRate) {
-        std::vector<float>& output =  layer[layer.size() - 1]->Y;
-        std::vector<float> dOut(output.size());
-        std::vector<float> *dE;
-        
+        backward(input, target, learningRate, state);
+    }
+
+    void backward(const std::vector<float> &input, const std::vector<float> &target, float learningRate, Workspace &ws) {
+        std::vector<float> *dE = backwardHidden(target, learningRate, ws);
+        layer[0]->updateWeights(input, learningRate, *dE, ws[0]);
+    }
+
+    /* *************************************************************** */
+    /* Inputs that are mostly one background value. After
+       setInputBackground the first layer keeps that part as a per-node
+       bias, and forward / backward with the foreground list of the
+       sample (the indices whose input differs from the background) only
+       touch those columns of the first layer. */
+    void setInputBackground(float value) {
+        layer[0]->setBackground(value);
+    }
+
+    const std::vector<float>& forward(const std::vector<float> &input, const std::vector<int> &foreground) {
+        layer[0]->evalForeground(input, foreground, state[0]);
+        for (int L = 1; L < layer.size(); L++) {
+            layer[L]->eval(state[L - 1].Y, state[L]);
+        }
+
+        return state.back().Y;
+    }
+
+    void backward(const std::vector<float> &input, const std::vector<int> &foreground, const std::vector<float> &target, float learningRate) {
+        std::vector<float> *dE = backwardHidden(target, learningRate, state);
+        layer[0]->updateWeightsForeground(input, foreground, learningRate, *dE, state[0]);
+    }
+
+    /* *************************************************************** */
+    /* Hogwild training: the samples are split in one contiguous shard per
+       pool thread, each thread runs forward/backward with its own Workspace
+       and updates the shared weights without locks. Overlapping updates
+       can overwrite each other, which sparse-gradient SGD tolerates.
+       fetch(i, input, target) fills the buffers of sample i and is called
+       from several threads at once. */
+    template <typename F>
+    TrainStats trainHogwild(int numSamples, float learningRate, F&& fetch) {
+        int numThreads = (pool != nullptr) ? pool->size() : 1;
+        while (hogwild.size() < numThreads) {
+            hogwild.push_back(HogwildShard{createWorkspace(), {}, {}, {0.0, 0}});
+        }
+        // the shards share the weights, the first layer must not fold its
+        // background shift from several threads
+        layer[0]->syncDense();
+
+        auto shard = [&](int tid, int nthreads) {
+            Workspace& ws = hogwild[tid].ws;
+            std::vector<float>& input = hogwild[tid].input;
+            std::vector<float>& target = hogwild[tid].target;
+            TrainStats& partial = hogwild[tid].stats;
+            partial = TrainStats{0.0, 0};
+            int from, to;
+            ThreadPool::split(0, numSamples, 1, tid, nthreads, from, to);
+            for (int i = from; i < to; ++i) {
+                fetch(i, input, target);
+                const std::vector<float>& output = forward(input, ws);
+                int predicted = (int)std::distance(output.begin(), std::max_element(output.begin(), output.end()));
+                int expected = (int)std::distance(target.begin(), std::max_element(target.begin(), target.end()));
+                if (predicted == expected) {
+                    partial.correct++;
+                }
+                for (int k = 0; k < output.size(); ++k) {
+                    partial.loss += 0.5 * (target[k] - output[k]) * (target[k] - output[k]);
+                }
+                backward(input, target, learningRate, ws);
+            }
+        };
+        if (pool != nullptr) {
+            pool->run(shard);
+        } else {
+            shard(0, 1);
+        }
+
+        TrainStats total{0.0, 0};
+        for (int t = 0; t < numThreads; t++) {
+            total.loss += hogwild[t].stats.loss;
+            total.correct += hogwild[t].stats.correct;
+        }
+        return total;
+    }
+
+    /* *************************************************************** */
+    /* Mini-batch training, input is count x numOfInputs and target is
+       count x outputs, both row-major */
+    const std::vector<float>& forwardBatch(const std::vector<float> &input, int count) {
+        layer[0]->evalBatch(input.data(), count, state[0]);
+        for (int L = 1; L < layer.size(); L++) {
+            layer[L]->evalBatch(state[L - 1].Yb.data(), count, state[L]);
+        }
+
+        return state.back().Yb;
+    }
+
+    void backwardBatch(const std::vector<float> &input, const std::vector<float> &target, int count, float learningRate) {
+        std::vector<float>& output = state.back().Yb;
+        dOutBatch.resize((size_t)count * (int)layer.back()->Ny);
+        const float *dE;
+
         // calculate Output error derivative
-        for (int i = 0; i < target.size(); i++) {
-            dOut[i] = 2.0 * (output[i] - target[i]);
+        for (size_t i = 0; i < dOutBatch.size(); i++) {
+            dOutBatch[i] = 2.0 * (output[i] - target[i]);
         }
-        dE = &dOut;
-        
+        dE = dOutBatch.data();
+
         for (int L = (int)layer.size() - 1; L > 0; L--){
-            dE = layer[L]->updateWeights(layer[L - 1]->Y, learningRate, *dE);
+            dE = layer[L]->updateWeightsBatch(state[L - 1].Yb.data(), count, learningRate, dE, state[L]);
         }
-        layer[0]->updateWeights(input, learningRate, *dE);
-        
+        layer[0]->updateWeightsBatch(input.data(), count, learningRate, dE, state[0]);
     }
 
-    ~NeuralNetwork() {
+    ~NeuralNetworkT() {
         for (Layer* ilayer : layer) {
             delete ilayer;
         }
+        delete pool;
+    }
+
+    // Splits every layer across numThreads threads (including the caller),
+    // the workers are created here once and reused for every call
+    void setThreads(int numThreads) {
+        delete pool;
+        pool = (numThreads > 1) ? new ThreadPool(numThreads) : nullptr;
+        for (int L = 0; L < layer.size(); L++) {
+            layer[L]->pool = pool;
+        }
     }
     
+    Activation* getActivation() const {
+        return activeFunction;
+    }
+
+    ThreadPool* getPool() const {
+        return pool;
+    }
+
     void setFastMode(bool fast) {
         for (int L = 0; L < layer.size(); L++) {
             layer[L]->fast = fast;
@@ -68,22 +233,133 @@ public:
     void printGradients() {
         for (int L = 0; L < layer.size(); L++) {
             std::cout <<"Layer " << L << std::endl;
-            for(int g = 0; g < layer[L]->dE_dX.size(); g++) {
-                std::cout << std::fixed << std::setw(11) << std::setprecision(6) << layer[L]->dE_dX[g] <<", ";
+            for(int g = 0; g < state[L].dE_dX.size(); g++) {
+                std::cout << std::fixed << std::setw(11) << std::setprecision(6) << state[L].dE_dX[g] <<", ";
             }
             std::cout << std::endl;
         }
     }
     
-    void saveWeights(std::string filename) {
+    /* *************************************************************** */
+    /* Magnitude pruning, every node keeps its largest (1 - sparsity) * Nx
+       weights. Training afterwards fine-tunes the kept weights. Both
+       return the fraction of the weights that was dropped. */
+    float prune(float sparsity) {
+        size_t kept = 0, total = 0;
+        for (int L = 0; L < layer.size(); L++) {
+            int nx = (int)layer[L]->Nx;
+            int k = std::max(1, (int)std::lround((1.0f - sparsity) * nx));
+            kept += layer[L]->pruneTopK(std::min(k, nx));
+            total += (size_t)nx * (int)layer[L]->Ny;
+        }
+        return 1.0f - (float)kept / total;
+    }
+
+    float pruneBelow(float threshold) {
+        size_t kept = 0, total = 0;
+        for (int L = 0; L < layer.size(); L++) {
+            kept += layer[L]->pruneBelow(threshold);
+            total += (size_t)(int)layer[L]->Nx * (int)layer[L]->Ny;
+        }
+        return 1.0f - (float)kept / total;
+    }
+
+    /* *************************************************************** */
+    /* Binary checkpoint, see Checkpoint.h for the layout */
+    bool saveWeights(const std::string& filename) {
+        std::vector<char> image;
+        snapshotWeights(image);
+        if (!writeCheckpointFile(filename, filename + ".tmp", image.data(), image.size())) {
+            std::cerr << "Unable to write file " << filename << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Copies the whole checkpoint file into image, which keeps its capacity
+    // between calls. This is the only part that needs the weights to hold
+    // still, the image can then be written out from another thread.
+    void snapshotWeights(std::vector<char>& image) {
+        uint64_t fileSize = checkpointTable();
+        image.resize(fileSize);
+        CheckpointHeader header = {};
+        std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+        header.version = CHECKPOINT_VERSION;
+        header.activation = activeFunction->getType();
+        header.numInputs = (uint32_t)layer[0]->Nx;
+        header.numLayers = (uint32_t)layer.size();
+        header.nodeParams = 1;
+
+        char* out = image.data();
+        size_t tableBytes = checkpointLayers.size() * sizeof(CheckpointLayer);
+        std::memcpy(out, &header, sizeof(header));
+        std::memcpy(out + sizeof(header), checkpointLayers.data(), tableBytes);
+        std::memset(out + sizeof(header) + tableBytes, 0, checkpointAlign(tableBytes) - tableBytes);
+        for (int L = 0; L < layer.size(); L++) {
+            const CheckpointLayer& entry = checkpointLayers[L];
+            size_t blockBytes = entry.size * sizeof(float);
+            layer[L]->syncDense();
+            std::memcpy(out + entry.offset, layer[L]->W, blockBytes);
+            std::memset(out + entry.offset + blockBytes, 0, checkpointAlign(blockBytes) - blockBytes);
+        }
+    }
+
+    // Maps a checkpoint written by saveWeights and points the layers at its
+    // parameter blocks, so inference runs straight from the page cache. The
+    // mapping is copy-on-write, training can go on without touching the file.
+    // The topology and activation must match this network.
+    bool loadWeights(const std::string& filename) {
+        MappedFile file;
+        if (!file.open(filename, true)) {
+            std::cerr << "Unable to open file " << filename << std::endl;
+            return false;
+        }
+        const char* error = checkpointError(file.data, file.length);
+        if (error != nullptr) {
+            std::cerr << error << " " << filename << std::endl;
+            return false;
+        }
+        const CheckpointHeader* header = reinterpret_cast<const CheckpointHeader*>(file.data);
+        uint64_t fileSize = checkpointTable();
+        const std::vector<CheckpointLayer>& table = checkpointLayers;
+        if (header->activation != (uint32_t)activeFunction->getType() || header->numInputs != (uint32_t)layer[0]->Nx
+            || header->numLayers != (uint32_t)layer.size() || header->nodeParams != 1) {
+            std::cerr << "Checkpoint file " << filename << " does not match the network" << std::endl;
+            return false;
+        }
+        if (file.length < fileSize) {
+            std::cerr << "Truncated checkpoint file " << filename << std::endl;
+            return false;
+        }
+        const CheckpointLayer* stored = reinterpret_cast<const CheckpointLayer*>(file.data + sizeof(CheckpointHeader));
+        for (int L = 0; L < layer.size(); L++) {
+            if (stored[L].numInputs != table[L].numInputs || stored[L].numOutputs != table[L].numOutputs
+                || stored[L].stride != table[L].stride || stored[L].offset != table[L].offset || stored[L].size != table[L].size) {
+                std::cerr << "Checkpoint file " << filename << " does not match the network (layer " << L << ")" << std::endl;
+                return false;
+            }
+        }
+
+        for (int L = 0; L < layer.size(); L++) {
+            layer[L]->attach(reinterpret_cast<float*>(file.data + table[L].offset));
+        }
+        // The previous mapping, if any, is released when file goes out of scope
+        checkpoint.swap(file);
+        return true;
+    }
+
+    // Text dump for reading the weights, one line per node: theta then the weights
+    void dumpWeights(std::string filename) {
         std::ofstream file;
         file.open (filename);
         for (int L = 0; L < layer.size(); L++) {
+            layer[L]->syncDense();
             file << "Layer " << L << std::endl;
-            for(int n = 0; n < layer[L]->node.size(); n++) {
-                file << layer[L]->node[n].theta;
-                for(int w = 0; w < layer[L]->node[n].W.size(); w++) {
-                    file << "," << layer[L]->node[n].W[w];
+            for(int n = 0; n < (int)layer[L]->Ny; n++) {
+                const float* W = layer[L]->row(n);
+                file << layer[L]->theta[n];
+                for(int w = 0; w < (int)layer[L]->Nx; w++) {
+                    file << "," << W[w];
                 }
                 file << std::endl;
             }
@@ -94,10 +370,50 @@ public:
 
 
 private:
+    // Output error and updates of every layer but the first, returns the
+    // error derivative at the outputs of the first layer
+    std::vector<float>* backwardHidden(const std::vector<float> &target, float learningRate, Workspace &ws) {
+        std::vector<float>& output =  ws.back().Y;
+        std::vector<float>& dOut = ws.back().dE_dY;
+        std::vector<float> *dE;
+        
+        // calculate Output error derivative
+        for (int i = 0; i < target.size(); i++) {
+            dOut[i] = 2.0 * (output[i] - target[i]);
+        }
+        dE = &dOut;
+        
+        for (int L = (int)layer.size() - 1; L > 0; L--){
+            dE = layer[L]->updateWeights(ws[L - 1].Y, learningRate, *dE, ws[L]);
+        }
+        return dE;
+    }
+
+    // Fills checkpointLayers for the current topology and returns the file size
+    uint64_t checkpointTable() {
+        checkpointLayers.resize(layer.size());
+        for (int L = 0; L < layer.size(); L++) {
+            checkpointLayers[L].numInputs = (uint32_t)layer[L]->Nx;
+            checkpointLayers[L].numOutputs = (uint32_t)layer[L]->Ny;
+            checkpointLayers[L].stride = (uint32_t)layer[L]->stride;
+            checkpointLayers[L].reserved = 0;
+            checkpointLayers[L].size = layer[L]->blockSize();
+        }
+        return checkpointLayout(checkpointLayers);
+    }
+
     std::vector<Layer*> layer;
-    AFunction* activeFunction;
+    ThreadPool* pool;
+    Workspace state;
+    std::vector<HogwildShard> hogwild;
+    std::vector<float> dOutBatch;
+    Activation* activeFunction;
+    MappedFile checkpoint;  // weights of the last loadWeights
+    std::vector<CheckpointLayer> checkpointLayers;
 };
 
+typedef NeuralNetworkT<AFunction> NeuralNetwork;
+
 
 
 #endif /* NeuralNetwork_h */
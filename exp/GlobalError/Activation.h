@@ -8,6 +8,9 @@
 #ifndef Activation_h
 #define Activation_h
 
+#include <cmath>
+#include "Kernels.h"
+
 class AFunction {
 public:
     enum Type {
@@ -18,21 +21,44 @@ public:
         Triangle,
         TriangleWave
     };
+    enum Precision {
+        Exact,      // libm, one value at a time
+        Fast        // polynomial kernels, see the error table in Kernels.h
+    };
     AFunction(float defaultLearnRate, float ealpha, float ebias)
-        :learnRate(defaultLearnRate), alpha(ealpha), bias(ebias)
+        :learnRate(defaultLearnRate), alpha(ealpha), bias(ebias), precision(Exact)
     {
     }
 public:
     virtual float eval(float z) = 0;
     virtual float derivative(float z, float y) = 0;
+
+    // Whole layer at once, y[i] = eval(z[i]). The concrete activations
+    // override these with loops the compiler can inline and vectorize.
+    virtual void evalSpan(const float* z, float* y, int n) {
+        for (int i = 0; i < n; ++i) {
+            y[i] = eval(z[i]);
+        }
+    }
+
+    // d[i] = derivative(z[i], y[i])
+    virtual void derivativeSpan(const float* z, const float* y, float* d, int n) {
+        for (int i = 0; i < n; ++i) {
+            d[i] = derivative(z[i], y[i]);
+        }
+    }
+
     virtual ~AFunction() {}
     virtual Type getType() = 0;
     float learnRate;
     float alpha;
     float bias;
+    Precision precision;
 };
 
-class Sigmoid : public AFunction {
+// The concrete activations are final, so LayerT<Sigmoid> and friends call
+// them directly and the compiler can inline them into the node loops
+class Sigmoid final : public AFunction {
 public:
     Sigmoid() : AFunction(0.02, 2.0, 0.0) { }
     
@@ -44,12 +70,34 @@ public:
         return y * (1.0 - y);
     }
     
+    void evalSpan(const float* z, float* y, int n) {
+        if (precision == Fast) {
+            for (int i = 0; i < n; ++i) {
+                y[i] = -z[i];
+            }
+            Kernels::get().expSpan(y, y, n);
+            for (int i = 0; i < n; ++i) {
+                y[i] = 1.0f / (1.0f + y[i]);
+            }
+            return;
+        }
+        for (int i = 0; i < n; ++i) {
+            y[i] = Sigmoid::eval(z[i]);
+        }
+    }
+
+    void derivativeSpan(const float* z, const float* y, float* d, int n) {
+        for (int i = 0; i < n; ++i) {
+            d[i] = Sigmoid::derivative(z[i], y[i]);
+        }
+    }
+
     Type getType() {
         return Type::Sigmoid;
     }
 };
 
-class Gauss : public AFunction {
+class Gauss final : public AFunction {
 public:
     Gauss() : AFunction(0.01, 1.0, 0.0) {}
     
@@ -61,13 +109,32 @@ public:
         return -2.0 * z * y;
     }
     
+    void evalSpan(const float* z, float* y, int n) {
+        if (precision == Fast) {
+            for (int i = 0; i < n; ++i) {
+                y[i] = -z[i] * z[i];
+            }
+            Kernels::get().expSpan(y, y, n);
+            return;
+        }
+        for (int i = 0; i < n; ++i) {
+            y[i] = Gauss::eval(z[i]);
+        }
+    }
+
+    void derivativeSpan(const float* z, const float* y, float* d, int n) {
+        for (int i = 0; i < n; ++i) {
+            d[i] = Gauss::derivative(z[i], y[i]);
+        }
+    }
+
     Type getType() {
         return Type::Gauss;
     }
 };
 
 
-class CosWave : public AFunction {
+class CosWave final : public AFunction {
 public:
     CosWave() : AFunction(0.01, M_PI, 0.5) {}
     float eval(float z) {
@@ -78,12 +145,38 @@ public:
         return sin(z) / 2.0;
     }
     
+    void evalSpan(const float* z, float* y, int n) {
+        if (precision == Fast) {
+            Kernels::get().cosSpan(z, y, n);
+            for (int i = 0; i < n; ++i) {
+                y[i] = (1.0f - y[i]) * 0.5f;
+            }
+            return;
+        }
+        for (int i = 0; i < n; ++i) {
+            y[i] = CosWave::eval(z[i]);
+        }
+    }
+
+    void derivativeSpan(const float* z, const float* y, float* d, int n) {
+        if (precision == Fast) {
+            Kernels::get().sinSpan(z, d, n);
+            for (int i = 0; i < n; ++i) {
+                d[i] = d[i] * 0.5f;
+            }
+            return;
+        }
+        for (int i = 0; i < n; ++i) {
+            d[i] = CosWave::derivative(z[i], y[i]);
+        }
+    }
+
     Type getType() {
         return Type::CosWave;
     }
 };
 
-class LRelu : public AFunction {
+class LRelu final : public AFunction {
 public:
     LRelu() : AFunction(0.01, 1.0, 0.0) {}
     float eval(float z) {
@@ -94,12 +187,24 @@ public:
         return (z > 0.0) ? 1.0 : 0.01;
     }
     
+    void evalSpan(const float* z, float* y, int n) {
+        for (int i = 0; i < n; ++i) {
+            y[i] = LRelu::eval(z[i]);
+        }
+    }
+
+    void derivativeSpan(const float* z, const float* y, float* d, int n) {
+        for (int i = 0; i < n; ++i) {
+            d[i] = LRelu::derivative(z[i], y[i]);
+        }
+    }
+
     Type getType() {
         return Type::LRelu;
     }
 };
 
-class Triangle : public AFunction {
+class Triangle final : public AFunction {
 public:
     Triangle() : AFunction(0.001, 1.0, 0.0) {}
     float eval(float z) {
@@ -110,12 +215,24 @@ public:
         return (z > 0.0) ? -1.0 : 1.0;
     }
 
+    void evalSpan(const float* z, float* y, int n) {
+        for (int i = 0; i < n; ++i) {
+            y[i] = Triangle::eval(z[i]);
+        }
+    }
+
+    void derivativeSpan(const float* z, const float* y, float* d, int n) {
+        for (int i = 0; i < n; ++i) {
+            d[i] = Triangle::derivative(z[i], y[i]);
+        }
+    }
+
     Type getType() {
         return Type::Triangle;
     }
 };
 
-class TriangleWave : public AFunction {
+class TriangleWave final : public AFunction {
 public:
     TriangleWave() : AFunction(0.001, 1.0, 0.0) {}
     float eval(float z) {
@@ -130,6 +247,33 @@ public:
         return (lz > 0.0) ? -1.0 : 1.0;
     }
 
+    void evalSpan(const float* z, float* y, int n) {
+        if (precision == Fast) {
+            // same wave in float, the fraction of z / 4 comes from the vector floor
+            Kernels::get().fracSpan(z, 0.25f, y, n);
+            for (int i = 0; i < n; ++i) {
+                y[i] = 1.0f - std::fabs(y[i] - 0.5f);
+            }
+            return;
+        }
+        for (int i = 0; i < n; ++i) {
+            y[i] = TriangleWave::eval(z[i]);
+        }
+    }
+
+    void derivativeSpan(const float* z, const float* y, float* d, int n) {
+        if (precision == Fast) {
+            Kernels::get().fracSpan(z, 0.25f, d, n);
+            for (int i = 0; i < n; ++i) {
+                d[i] = (d[i] - 0.5f > 0.0f) ? -1.0f : 1.0f;
+            }
+            return;
+        }
+        for (int i = 0; i < n; ++i) {
+            d[i] = TriangleWave::derivative(z[i], y[i]);
+        }
+    }
+
     Type getType() {
         return Type::TriangleWave;
     }
@@ -10,37 +10,117 @@
 
 #include <vector>
 #include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <new>
 #include "Activation.h"
+#include "Kernels.h"
+#include "ThreadPool.h"
+#include "Profiler.h"
 
 
-struct Node {
-    std::vector<float> W;
-    float theta;
-    float eval(const std::vector<float>& input) {
-        float z = theta;
-        for (int i = 0; i < input.size(); ++i) {
-            z += input[i] * W[i];
+// Foreground updates between two folds of the background shift into W,
+// one fold streams the whole layer once
+const int BACKGROUND_FOLD = 1024;
+
+
+/* *************************************************************** */
+/* Allocator for cache line aligned buffers */
+template <typename T, std::size_t Alignment = 64>
+struct AlignedAllocator {
+    typedef T value_type;
+    template <typename U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+    AlignedAllocator() {}
+    template <typename U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate(std::size_t count) {
+        std::size_t bytes = (count * sizeof(T) + Alignment - 1) / Alignment * Alignment;
+        void* ptr = std::aligned_alloc(Alignment, bytes);
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
         }
-        return z;
+        return static_cast<T*>(ptr);
     }
+
+    void deallocate(T* ptr, std::size_t) {
+        std::free(ptr);
+    }
+
+    template <typename U> bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+    template <typename U> bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
 };
 
+typedef std::vector<float, AlignedAllocator<float>> AlignedVector;
+typedef std::vector<uint16_t, AlignedAllocator<uint16_t>> AlignedHalves;
+
+// Rows or columns per block when a layer is split across the pool, a
+// multiple of 16 floats keeps the threads off each other's cache lines
+const int PARALLEL_GRAIN = 16;
+
+// Weights of a layer per pool thread, below this waking a worker costs
+// more than the share of the pass it takes over
+const int PARALLEL_MIN_WEIGHTS = 32768;
+
+
+/* *************************************************************** */
+/* Activations of one layer for one caller. Layer itself only holds the
+   weights, so several threads can share a Layer, each with its own state */
+struct LayerState {
+    void resize(int numOfInputs, int numOfOutputs) {
+        Z.resize(numOfOutputs);
+        Y.resize(numOfOutputs);
+        dE_dY.resize(numOfOutputs);
+        dE_dZ.resize(numOfOutputs);
+        dE_dX.resize(numOfInputs);
+        Xf.resize(numOfInputs);
+        sumXf = 0.0f;
+        batchSize = 0;
+    }
+
+    std::vector<float> Z;
+    std::vector<float> Y;
+    std::vector<float> dE_dY;       // error derivative arriving at the outputs
+    std::vector<float> dE_dZ;
+    std::vector<float> dE_dX;
+    std::vector<float> Xf;      // foreground inputs minus the background, see evalForeground
+    float sumXf;
+    std::vector<float> Zb;      // batch buffers, batchSize rows
+    std::vector<float> Yb;
+    std::vector<float> dE_dZb;
+    std::vector<float> dE_dXb;
+    int batchSize;
+};
 
 
-class Layer {
+/* *************************************************************** */
+/* Activation is either AFunction, dispatched at run time, or one of the
+   concrete (final) activation classes, which lets the compiler inline
+   eval/derivative into the node loops */
+template <typename Activation = AFunction>
+class LayerT {
 public:
-    Layer(int numOfInputs, int numOfOutputs, AFunction *activeFunction) {
+    LayerT(int numOfInputs, int numOfOutputs, Activation *activeFunction) {
         this->activeFunction = activeFunction;
         this->fast = true;
         Nx = numOfInputs;
         Ny = numOfOutputs;
-        node.resize(numOfOutputs, Node{
-           .W = std::vector<float>(numOfInputs),
-           .theta = 0
-        });
-        Z.resize(numOfOutputs);
-        Y.resize(numOfOutputs);
-        dE_dX.resize(numOfInputs);
+        // Every row starts on a cache line, the padding is kept at zero.
+        // Strides that are a multiple of 1KB map every row to the same
+        // cache sets, so those get one extra line.
+        stride = (numOfInputs + 15) & ~15;
+        if (stride % 256 == 0) {
+            stride += 16;
+        }
+        index = 0;
+        sparse = false;
+        hasBackground = false;
+        transposed = false;
+        unfolded = 0;
+        storage.assign(blockSize(), 0.0f);
+        attach(storage.data());
+        pool = nullptr;
         
         /* *************************************************************** */
         /* Init values */
@@ -51,65 +131,538 @@ public:
         std::mt19937 gen(rd());
         std::normal_distribution<> d(0.0, 1.0);
  
-        for (int n = 0; n < node.size(); ++n) {
-            Node& inode = node[n];
+        for (int n = 0; n < numOfOutputs; ++n) {
+            float* w = row(n);
             for (int i = 0; i < numOfInputs; ++i) {
-                inode.W[i] = initAlpha * d(gen) / Nx;
+                w[i] = initAlpha * d(gen) / Nx;
+            }
+            theta[n] = initTheta;
+        }
+    }
+
+    float* row(int n) {
+        return W + (size_t)n * stride;
+    }
+
+    // Floats in the parameter block: the W rows, then theta padded to a cache line
+    size_t blockSize() const {
+        return (size_t)(int)Ny * stride + (((int)Ny + 15) & ~15);
+    }
+
+    // Points W and theta at a parameter block laid out as blockSize()
+    // describes, storage itself or a block of a mapped checkpoint.
+    // A pruned layer goes back to dense, the new block has its own zeros.
+    void attach(float* block) {
+        densify();
+        W = block;
+        theta = block + (size_t)(int)Ny * stride;
+        if (block != storage.data()) {
+            AlignedVector().swap(storage);
+        }
+        // WT, if any, holds the old weights
+        transposed = false;
+    }
+
+    // Runs body(from, to) over [begin, end), one pass over the layer
+    template <typename F>
+    void parallel(int begin, int end, F&& body) {
+        parallel(begin, end, sparse ? (double)values.size() : (double)(int)Nx * (int)Ny, body);
+    }
+
+    // With a pool every thread gets at least PARALLEL_MIN_WEIGHTS of the
+    // weights the pass reads, so a small pass, or a range of one block,
+    // stays on the calling thread
+    template <typename F>
+    void parallel(int begin, int end, double weights, F&& body) {
+        int threads = (int)(weights / PARALLEL_MIN_WEIGHTS);
+        if (pool != nullptr && pool->size() > 1 && threads > 1 && end - begin > PARALLEL_GRAIN) {
+            pool->parallelFor(begin, end, PARALLEL_GRAIN, body, threads);
+        } else {
+            body(begin, end);
+        }
+    }
+
+    /* *************************************************************** */
+    /* Pruning. The kept weights are copied into CSR arrays (rowStart,
+       column, values) that eval and updateWeights use from then on, so
+       fine-tuning only moves the kept weights and the dropped ones stay
+       zero. W holds the values of the last syncDense. */
+
+    // Drops the weights with |w| < threshold, returns how many are kept
+    int pruneBelow(float threshold) {
+        syncDense();
+        for (int n = 0; n < (int)Ny; ++n) {
+            float* w = row(n);
+            for (int i = 0; i < (int)Nx; ++i) {
+                if (std::fabs(w[i]) < threshold) {
+                    w[i] = 0.0f;
+                }
+            }
+        }
+        return compress();
+    }
+
+    // Keeps the k largest |w| of every node, returns how many are kept
+    int pruneTopK(int k) {
+        int nx = (int)Nx;
+        syncDense();
+        if (k < nx) {
+            std::vector<float> magnitude(nx);
+            for (int n = 0; n < (int)Ny; ++n) {
+                float* w = row(n);
+                for (int i = 0; i < nx; ++i) {
+                    magnitude[i] = std::fabs(w[i]);
+                }
+                std::nth_element(magnitude.begin(), magnitude.begin() + (nx - k), magnitude.end());
+                float cut = magnitude[nx - k];
+                // ties with the cut are kept from the left until there are k
+                int above = 0;
+                for (int i = 0; i < nx; ++i) {
+                    above += (std::fabs(w[i]) > cut);
+                }
+                int ties = k - above;
+                for (int i = 0; i < nx; ++i) {
+                    float a = std::fabs(w[i]);
+                    if (a < cut || (a == cut && ties-- <= 0)) {
+                        w[i] = 0.0f;
+                    }
+                }
+            }
+        }
+        return compress();
+    }
+
+    // Copies the CSR values back into W
+    void syncDense() {
+        if (unfolded > 0) {
+            foldBackground();
+        }
+        if (!sparse) {
+            return;
+        }
+        for (int n = 0; n < (int)Ny; ++n) {
+            float* w = row(n);
+            for (int j = rowStart[n]; j < rowStart[n + 1]; ++j) {
+                w[column[j]] = values[j];
             }
-            inode.theta = initTheta;
         }
     }
 
-    void eval(const std::vector<float>& input) {
-        for (int n = 0; n < node.size(); ++n) {
-            Z[n] = node[n].eval(input);
-            Y[n] = activeFunction->eval(Z[n]);
+    // Back to training every weight of W
+    void densify() {
+        syncDense();
+        sparse = false;
+        std::vector<int>().swap(rowStart);
+        std::vector<int>().swap(column);
+        AlignedVector().swap(values);
+    }
+
+    // Builds the CSR arrays from the non-zero weights of W
+    int compress() {
+        rowStart.assign(1, 0);
+        column.clear();
+        values.clear();
+        for (int n = 0; n < (int)Ny; ++n) {
+            const float* w = row(n);
+            for (int i = 0; i < (int)Nx; ++i) {
+                if (w[i] != 0.0f) {
+                    column.push_back(i);
+                    values.push_back(w[i]);
+                }
+            }
+            rowStart.push_back((int)column.size());
         }
+        sparse = true;
+        transposed = false;
+        return (int)column.size();
+    }
+
+    // Entries [j0, j1) of row n whose columns are in [from, to)
+    void sparseRange(int n, int from, int to, int& j0, int& j1) const {
+        const int* begin = column.data() + rowStart[n];
+        const int* end = column.data() + rowStart[n + 1];
+        const int* first = std::lower_bound(begin, end, from);
+        j0 = (int)(first - column.data());
+        j1 = (int)(std::lower_bound(first, end, to) - column.data());
+    }
+
+    // Weights in the columns [from, to) of W, on average once pruned.
+    // Only the profiler counts with it.
+    double columnEntries(int from, int to) const {
+        return sparse ? (double)values.size() * (to - from) / (int)Nx : (double)(int)Ny * (to - from);
+    }
+
+    /* *************************************************************** */
+    /* Inputs that mostly sit at one background value b, like the MNIST
+       background pixels. With x = b + d, W x = b * rowSum + W d and d is
+       zero outside the foreground list of the sample. The update
+       W -= r * g * x splits the same way: the b part moves every weight
+       of row n by the same amount, which collects in shift[n], and only
+       the foreground weights are written per sample. Those are read and
+       written as columns of W, so the foreground path keeps a transposed
+       copy WT that holds the weights (plus shift[n]) until
+       foldBackground copies it back to W. */
+    void setBackground(float value) {
+        syncDense();
+        background = value;
+        hasBackground = true;
+        strideT = ((int)Ny + 15) & ~15;
+        WT.assign((size_t)(int)Nx * strideT, 0.0f);
+        rowSum.assign((int)Ny, 0.0f);
+        shift.assign((int)Ny, 0.0f);
+        transposed = false;
+    }
+
+    // Column i of W
+    float* rowT(int i) {
+        return WT.data() + (size_t)i * strideT;
     }
 
-    std::vector<float>* updateWeights(const std::vector<float> &input, float learningRate, const std::vector<float>& dE) {
+    // Copies W into WT, after W changed outside the foreground path
+    void transposeW() {
+        int nx = (int)Nx;
+        parallel(0, (int)Ny, [&](int from, int to) {
+            for (int n = from; n < to; ++n) {
+                const float* w = row(n);
+                double sum = 0.0;
+                for (int i = 0; i < nx; ++i) {
+                    rowT(i)[n] = w[i];
+                    sum += w[i];
+                }
+                rowSum[n] = (float)sum;
+                shift[n] = 0.0f;
+            }
+        });
+        transposed = true;
+        unfolded = 0;
+    }
+
+    // Writes WT plus the pending shift back to W and recomputes
+    // the row sums, WT stays valid
+    void foldBackground() {
+        int nx = (int)Nx;
+        parallel(0, (int)Ny, [&](int from, int to) {
+            for (int n = from; n < to; ++n) {
+                float* w = row(n);
+                float c = shift[n];
+                double sum = 0.0;
+                for (int i = 0; i < nx; ++i) {
+                    float v = rowT(i)[n] + c;
+                    rowT(i)[n] = v;
+                    w[i] = v;
+                    sum += v;
+                }
+                rowSum[n] = (float)sum;
+                shift[n] = 0.0f;
+            }
+        });
+        unfolded = 0;
+    }
+
+    // eval for an input whose pixels outside foreground equal the background.
+    // Without a background, or once pruned, this is the plain eval.
+    void evalForeground(const std::vector<float>& input, const std::vector<int>& foreground, LayerState& state) {
+        if (!hasBackground || sparse) {
+            eval(input, state);
+            return;
+        }
+        if (!transposed) {
+            transposeW();
+        }
+        const Kernels& k = Kernels::get();
+        int count = (int)foreground.size();
+        float* Xf = state.Xf.data();
+        float sumXf = 0.0f;
+        for (int j = 0; j < count; ++j) {
+            Xf[j] = input[foreground[j]] - background;
+            sumXf += Xf[j];
+        }
+        state.sumXf = sumXf;
+        float sumX = Nx * background + sumXf;
+        std::vector<float>& Z = state.Z;
+        std::vector<float>& Y = state.Y;
+        parallel(0, (int)Ny, (double)count * (int)Ny, [&](int from, int to) {
+            {
+                ANN_PROFILE_SCOPE(index, PhaseEval, 2.0 * count * (to - from), 4.0 * count * (to - from));
+                for (int n = from; n < to; ++n) {
+                    Z[n] = theta[n] + background * rowSum[n] + shift[n] * sumX;
+                }
+                for (int j = 0; j < count; ++j) {
+                    k.axpy(Xf[j], rowT(foreground[j]) + from, Z.data() + from, to - from);
+                }
+            }
+            ANN_PROFILE_SCOPE(index, PhaseActivation, to - from, 8.0 * (to - from));
+            activeFunction->evalSpan(&Z[from], &Y[from], to - from);
+        });
+    }
+
+    // updateWeights after evalForeground. This is the input layer, so no
+    // dE_dX is formed.
+    void updateWeightsForeground(const std::vector<float> &input, const std::vector<int>& foreground, float learningRate, const std::vector<float>& dE, LayerState& state) {
+        if (!hasBackground || sparse) {
+            updateWeights(input, learningRate, dE, state);
+            return;
+        }
+        const Kernels& k = Kernels::get();
+        int ny = (int)Ny;
+        int count = (int)foreground.size();
+        const float* Xf = state.Xf.data();
+        float sumXf = state.sumXf;
+        std::vector<float>& dE_dZ = state.dE_dZ;
+
+        {
+            ANN_PROFILE_SCOPE(index, PhaseGradient, 2.0 * ny, 16.0 * ny);
+            activeFunction->derivativeSpan(state.Z.data(), state.Y.data(), dE_dZ.data(), ny);
+            for (int n = 0; n < ny; n++) {
+                dE_dZ[n] *= dE[n];
+                theta[n] -= (learningRate) * dE_dZ[n];
+            }
+        }
+
+        // dE_dZ becomes the step of every node, rowT(i) += x_i * step
+        float rateW = learningRate / (fast ? 1.0f : (Nx / 2.0f));
+        parallel(0, ny, (double)count * ny, [&](int from, int to) {
+            ANN_PROFILE_SCOPE(index, PhaseUpdate, 2.0 * count * (to - from), 8.0 * count * (to - from));
+            for (int n = from; n < to; ++n) {
+                dE_dZ[n] *= -rateW;
+                shift[n] += dE_dZ[n] * background;
+                rowSum[n] += dE_dZ[n] * sumXf;
+            }
+            for (int j = 0; j < count; ++j) {
+                k.axpy(Xf[j], dE_dZ.data() + from, rowT(foreground[j]) + from, to - from);
+            }
+        });
+        // rowSum drifts from the weights by rounding, it is recomputed now and then
+        if (++unfolded >= BACKGROUND_FOLD) {
+            foldBackground();
+        }
+    }
+
+    void eval(const std::vector<float>& input, LayerState& state) {
+        if (unfolded > 0) {
+            foldBackground();
+        }
+        const Kernels& k = Kernels::get();
+        int nx = (int)Nx;
+        std::vector<float>& Z = state.Z;
+        std::vector<float>& Y = state.Y;
+        parallel(0, (int)Ny, [&](int from, int to) {
+            if (sparse) {
+                ANN_PROFILE_SCOPE(index, PhaseEval, 2.0 * (rowStart[to] - rowStart[from]), 8.0 * (rowStart[to] - rowStart[from]));
+                k.spmv(to - from, rowStart.data() + from, column.data(), values.data(), input.data(), Z.data() + from);
+                for (int n = from; n < to; ++n) {
+                    Z[n] += theta[n];
+                }
+            } else {
+                ANN_PROFILE_SCOPE(index, PhaseEval, 2.0 * nx * (to - from), 4.0 * nx * (to - from));
+                for (int n = from; n < to; ++n) {
+                    Z[n] = theta[n] + k.dot(input.data(), row(n), nx);
+                }
+            }
+            // separate pass, so an inlined activation vectorizes
+            ANN_PROFILE_SCOPE(index, PhaseActivation, to - from, 8.0 * (to - from));
+            activeFunction->evalSpan(&Z[from], &Y[from], to - from);
+        });
+    }
+
+    std::vector<float>* updateWeights(const std::vector<float> &input, float learningRate, const std::vector<float>& dE, LayerState& state) {
+        if (unfolded > 0) {
+            foldBackground();
+        }
+        transposed = false;
+        const Kernels& k = Kernels::get();
+        int nx = (int)Nx;
+        int ny = (int)Ny;
+        std::vector<float>& Z = state.Z;
+        std::vector<float>& Y = state.Y;
+        std::vector<float>& dE_dZ = state.dE_dZ;
+        std::vector<float>& dE_dX = state.dE_dX;
+
         /* *********************************************************** */
         // calculate Transfer Gradients
-        std::vector<float> dE_dZ(Y.size());
-        for (int n = 0; n < Y.size(); n++) {
-            dE_dZ[n] = dE[n] * activeFunction->derivative(Z[n], Y[n]);
+        {
+            ANN_PROFILE_SCOPE(index, PhaseGradient, 2.0 * ny, 16.0 * ny);
+            activeFunction->derivativeSpan(Z.data(), Y.data(), dE_dZ.data(), ny);
+            for (int n = 0; n < ny; n++) {
+                dE_dZ[n] *= dE[n];
+            }
         }
 
         /* *********************************************************** */
-        // calculate Transfer Gradients for previous layer
-        // if it's the input layer, there is no need to transfer gradients
+        // calculate Transfer Gradients for previous layer and update Weights.
+        // Each row is streamed once: its old weights are accumulated into
+        // dE_dX (dE_dX += dE_dZ[n] * W[n,:]) before being updated in place.
+        // Threads take column slices of every row, so each owns its part
+        // of dE_dX and no reduction is needed.
+        float rateW = learningRate / (fast ? 1.0f : (Nx / 2.0f));
+        parallel(0, nx, [&](int from, int to) {
+            // W is read and written back, x and dE_dX stay in L1
+            ANN_PROFILE_SCOPE(index, PhaseBackpropUpdate, 4.0 * columnEntries(from, to), (sparse ? 12.0 : 8.0) * columnEntries(from, to));
+            std::fill(dE_dX.begin() + from, dE_dX.begin() + to, 0.0f);
+            for (int n = 0; n < ny; ++n) {
+                if (sparse) {
+                    int j0, j1;
+                    sparseRange(n, from, to, j0, j1);
+                    k.backpropRowSparse(dE_dZ[n], -rateW * dE_dZ[n], column.data() + j0, input.data(), values.data() + j0, dE_dX.data(), j1 - j0);
+                } else {
+                    k.backpropRow(dE_dZ[n], -rateW * dE_dZ[n], input.data() + from, row(n) + from, dE_dX.data() + from, to - from);
+                }
+            }
+        });
+        ANN_PROFILE_SCOPE(index, PhaseUpdate, 2.0 * ny, 8.0 * ny);
+        for (int n = 0; n < ny; ++n) {
+            theta[n] -= (learningRate) * dE_dZ[n];
+        }
+
+        return &dE_dX;
+    }
+
+    /* *************************************************************** */
+    /* Mini-batch versions, samples are rows of count x Nx blocks */
+    void resizeBatch(int count, LayerState& state) {
+        if (state.batchSize == count) {
+            return;
+        }
+        state.batchSize = count;
+        state.Zb.resize((size_t)count * (int)Ny);
+        state.Yb.resize((size_t)count * (int)Ny);
+        state.dE_dZb.resize((size_t)count * (int)Ny);
+        state.dE_dXb.resize((size_t)count * (int)Nx);
+    }
 
-        for (int i = 0; i < input.size(); i++) {
-            dE_dX[i] = 0.0;
-            for (int n = 0; n < Y.size(); n++) {
-                dE_dX[i] += node[n].W[i] * dE_dZ[n];
+    void evalBatch(const float* input, int count, LayerState& state) {
+        if (unfolded > 0) {
+            foldBackground();
+        }
+        const Kernels& k = Kernels::get();
+        int nx = (int)Nx;
+        int ny = (int)Ny;
+        resizeBatch(count, state);
+        std::vector<float>& Zb = state.Zb;
+        std::vector<float>& Yb = state.Yb;
+        parallel(0, ny, [&](int from, int to) {
+            if (sparse) {
+                ANN_PROFILE_SCOPE(index, PhaseEval, 2.0 * count * (rowStart[to] - rowStart[from]), 8.0 * count * (rowStart[to] - rowStart[from]));
+                for (int b = 0; b < count; ++b) {
+                    k.spmv(to - from, rowStart.data() + from, column.data(), values.data(), input + (size_t)b * nx, &Zb[(size_t)b * ny + from]);
+                }
+            } else {
+                ANN_PROFILE_SCOPE(index, PhaseEval, 2.0 * count * nx * (to - from), 4.0 * nx * (to - from + count));
+                k.gemmNT(count, to - from, nx, input, nx, row(from), stride, Zb.data() + from, ny);
+            }
+            ANN_PROFILE_SCOPE(index, PhaseActivation, count * (to - from), 8.0 * count * (to - from));
+            for (int b = 0; b < count; ++b) {
+                float* z = &Zb[(size_t)b * ny];
+                float* y = &Yb[(size_t)b * ny];
+                for (int n = from; n < to; ++n) {
+                    z[n] += theta[n];
+                }
+                activeFunction->evalSpan(z + from, y + from, to - from);
             }
+        });
+    }
+
+    // Gradients are summed over the batch, so a batch of one matches updateWeights
+    const float* updateWeightsBatch(const float* input, int count, float learningRate, const float* dE, LayerState& state) {
+        if (unfolded > 0) {
+            foldBackground();
         }
+        transposed = false;
+        const Kernels& k = Kernels::get();
+        int nx = (int)Nx;
+        int ny = (int)Ny;
+        std::vector<float>& dE_dZb = state.dE_dZb;
+        std::vector<float>& dE_dXb = state.dE_dXb;
+        float rateW = learningRate / (fast ? 1.0f : (Nx / 2.0f));
 
+        /* *********************************************************** */
+        // calculate Transfer Gradients
+        {
+            ANN_PROFILE_SCOPE(index, PhaseGradient, 2.0 * count * ny, 16.0 * count * ny);
+            activeFunction->derivativeSpan(state.Zb.data(), state.Yb.data(), dE_dZb.data(), count * ny);
+            for (size_t j = 0; j < (size_t)count * ny; ++j) {
+                dE_dZb[j] *= dE[j];
+            }
+        }
+
+        /* *********************************************************** */
+        // calculate Transfer Gradients for previous layer with the old weights
+        parallel(0, nx, [&](int from, int to) {
+            ANN_PROFILE_SCOPE(index, PhaseBackprop, 2.0 * count * columnEntries(from, to), (sparse ? 8.0 : 4.0) * columnEntries(from, to) + 4.0 * count * (ny + to - from));
+            if (sparse) {
+                for (int b = 0; b < count; ++b) {
+                    float* dx = &dE_dXb[(size_t)b * nx];
+                    std::fill(dx + from, dx + to, 0.0f);
+                    for (int n = 0; n < ny; ++n) {
+                        float g = dE_dZb[(size_t)b * ny + n];
+                        int j0, j1;
+                        sparseRange(n, from, to, j0, j1);
+                        for (int j = j0; j < j1; ++j) {
+                            dx[column[j]] += g * values[j];
+                        }
+                    }
+                }
+            } else {
+                k.gemmNN(count, ny, to - from, dE_dZb.data(), ny, W + from, stride, dE_dXb.data() + from, nx);
+            }
+        });
 
         /* *********************************************************** */
-        // updating Weights
-        for (int n = 0; n < node.size(); ++n) {
-            Node& inode = node[n];
-            for (int i = 0; i < input.size(); ++i) {
-                inode.W[i] -= (learningRate / (fast ? 1.0f : (Nx / 2.0f))) * input[i] * dE_dZ[n] ;
+        // updating Weights, W -= rateW * dE_dZ^T * input
+        ANN_PROFILE_SCOPE(index, PhaseUpdate, (sparse ? 2.0 * values.size() : 2.0 * nx * ny) * count, (sparse ? 16.0 * values.size() : 8.0 * nx * ny) + 4.0 * count * (nx + ny));
+        for (int b = 0; b < count; ++b) {
+            for (int n = 0; n < ny; ++n) {
+                theta[n] -= (learningRate) * dE_dZb[(size_t)b * ny + n];
             }
-            inode.theta -= (learningRate) * dE_dZ[n];
         }
+        for (size_t j = 0; j < (size_t)count * ny; ++j) {
+            dE_dZb[j] *= -rateW;
+        }
+        parallel(0, ny, [&](int from, int to) {
+            if (sparse) {
+                for (int n = from; n < to; ++n) {
+                    for (int b = 0; b < count; ++b) {
+                        float g = dE_dZb[(size_t)b * ny + n];
+                        const float* x = input + (size_t)b * nx;
+                        for (int j = rowStart[n]; j < rowStart[n + 1]; ++j) {
+                            values[j] += g * x[column[j]];
+                        }
+                    }
+                }
+            } else {
+                k.gemmTN(count, to - from, nx, dE_dZb.data() + from, ny, input, nx, row(from), stride);
+            }
+        });
 
-        return &dE_dX;
+        return dE_dXb.data();
     }
     
     
 public:
-    std::vector<Node> node;
-    std::vector<float> Z;
-    std::vector<float> Y;
-    std::vector<float> dE_dX;
-    AFunction* activeFunction;
+    float* W;               // Ny rows of stride floats, row-major
+    float* theta;
+    AlignedVector storage;  // parameter block, released when a checkpoint is mapped
+    bool sparse;            // set by pruning, then the CSR arrays hold the weights
+    std::vector<int> rowStart;
+    std::vector<int> column;
+    AlignedVector values;
+    bool hasBackground;     // set by setBackground, for the input layer
+    float background;
+    AlignedVector WT;       // Nx rows of strideT floats, the columns of W
+    int strideT;
+    bool transposed;        // WT holds the weights, W is behind while unfolded > 0
+    AlignedVector rowSum;   // sum of each row of the weights without shift
+    AlignedVector shift;    // pending, added to every weight of the row
+    int unfolded;           // foreground updates since the last foldBackground
+    ThreadPool* pool;       // not owned, set by NeuralNetwork::setThreads
+    int index;              // position in the network, for the profiler
+    Activation* activeFunction;
     float Nx;
     float Ny;
+    int stride;
     bool fast;
 };
 
+typedef LayerT<AFunction> Layer;
+
 #endif /* Layer_hpp */
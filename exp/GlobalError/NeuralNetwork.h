@@ -8,90 +8,320 @@
 #ifndef NeuralNetwork_h
 #define NeuralNetwork_h
 
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
 #include <vector>
 #include <cmath>
 #include <random>
+#include <algorithm>
 #include <set>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <utility>
 #include "Activation.h"
 #include "Layer.h"
+#include "ThreadPool.h"
+#include "MappedFile.h"
+#include "Checkpoint.h"
 
 
-class NeuralNetwork {
+// Activations of every layer, one per thread that runs the network
+typedef std::vector<LayerState> Workspace;
+
+struct TrainStats {
+    double loss;
+    int correct;
+};
+
+// Sparse map from the output error to a feedback layer of another width
+struct FeedbackRemap {
+    std::vector<int> rowStart;
+    std::vector<int> column;
+    std::vector<float> values;
+};
+
+// Buffers of one sample in flight in trainPipelined
+struct PipelineSlot {
+    Workspace ws;
+    std::vector<float> input;
+    std::vector<int> foreground;
+    std::vector<float> target;
+};
+
+// Buffers of one hogwild thread, kept between epochs
+struct HogwildShard {
+    Workspace ws;
+    std::vector<float> input;
+    std::vector<float> target;
+    TrainStats stats;
+};
+
+
+// NeuralNetworkT<TriangleWave> etc. inline the activation in every layer,
+// NeuralNetwork keeps the virtual AFunction so it can be picked at run time
+template <typename Activation = AFunction>
+class NeuralNetworkT {
 public:
-    NeuralNetwork(int numOfInputs, const std::vector<int> layers, AFunction* activeFunction) {
+    typedef LayerT<Activation> Layer;
+
+    NeuralNetworkT(int numOfInputs, const std::vector<int> layers, Activation* activeFunction) {
         this->activeFunction = activeFunction;
+        this->pool = nullptr;
         
         layer.push_back(new Layer(numOfInputs, layers[0], activeFunction));
         for (int i = 1; i < layers.size(); i++) {
             layer.push_back(new Layer(layers[i - 1], layers[i], activeFunction));
         }
+        for (int L = 0; L < layer.size(); L++) {
+            layer[L]->index = L;
+        }
+        state = createWorkspace();
         
         feedback.insert(0);
         feedback.insert((int)layers.size() - 1);
+        buildSegments();
     }
     
     void setFeedback(const std::vector<int> &flayer) {
         for (int idxLayer : flayer) {
             feedback.insert(idxLayer);
         }
+        buildSegments();
+    }
+
+    Workspace createWorkspace() const {
+        Workspace ws(layer.size());
+        for (int L = 0; L < layer.size(); L++) {
+            ws[L].resize((int)layer[L]->Nx, (int)layer[L]->Ny);
+        }
+        return ws;
+    }
+
+    // The returned outputs are overwritten by the next call
+    const std::vector<float>& forward(const std::vector<float> &input) {
+        return forward(input, state);
     }
 
-    std::vector<float> forward(const std::vector<float> &input) {
-        layer[0]->eval(input);
+    const std::vector<float>& forward(const std::vector<float> &input, Workspace &ws) {
+        layer[0]->eval(input, ws[0]);
         for (int L = 1; L < layer.size(); L++) {
-            layer[L]->eval(layer[L - 1]->Y);
+            layer[L]->eval(ws[L - 1].Y, ws[L]);
         }
         
-        return layer.back()->Y;
+        return ws.back().Y;
     }
     
     void backwardWithFeedback(const std::vector<float> &input, const std::vector<float> &target, float learningRate) {
-        std::vector<float>& output =  layer[layer.size() - 1]->Y;
-        std::vector<float> dOut(output.size());
-        std::vector<float> dEVar(output.size());
-        std::vector<float> *dE;
+        backwardWithFeedback(input, nullptr, target, learningRate);
+    }
+
+    /* *************************************************************** */
+    /* Inputs that are mostly one background value. After
+       setInputBackground the first layer keeps that part as a per-node
+       bias, and forward / backwardWithFeedback with the foreground list
+       of the sample (the indices whose input differs from the background)
+       only touch those columns of the first layer. */
+    void setInputBackground(float value) {
+        layer[0]->setBackground(value);
+    }
+
+    const std::vector<float>& forward(const std::vector<float> &input, const std::vector<int> &foreground) {
+        layer[0]->evalForeground(input, foreground, state[0]);
+        for (int L = 1; L < layer.size(); L++) {
+            layer[L]->eval(state[L - 1].Y, state[L]);
+        }
+
+        return state.back().Y;
+    }
+
+    void backwardWithFeedback(const std::vector<float> &input, const std::vector<int> &foreground, const std::vector<float> &target, float learningRate) {
+        backwardWithFeedback(input, &foreground, target, learningRate);
+    }
+
+    // foreground is nullptr for a dense input
+    void backwardWithFeedback(const std::vector<float> &input, const std::vector<int> *foreground, const std::vector<float> &target, float learningRate) {
+        std::vector<float>& output =  state.back().Y;
+        std::vector<float>& dOut = state.back().dE_dY;
         
         // calculate Output error derivative
         for (int i = 0; i < target.size(); i++) {
             dOut[i] = 2.0 * (output[i] - target[i]);
         }
-        dE = &dOut;
-        int startLayer, endLayer;
-        std::set<int>::iterator endIt = feedback.begin();
-        startLayer = *endIt;
-        endIt++;
-        
-        while (endIt != feedback.end()) {
-            endLayer = *endIt;
-            dE = &dOut;
-
-            // Adapt error derivative to destination size
-            if (dOut.size() != layer[endLayer]->Ny) {
-                dEVar.assign(layer[endLayer]->Ny, 0.0f);
-                if(dOut.size() < dEVar.size()) {
-                    for (int i = 0; i < dEVar.size(); i++) {
-                        dEVar[i] = dOut[i % dOut.size()];
-                    }
+
+        // The segments only share the activations of the forward pass, so
+        // the pool threads take whole segments, largest (the input layer)
+        // first, and run their layers serially. No more threads than
+        // segments are woken.
+        int numSegments = (int)segment.size();
+        if (pool != nullptr && pool->size() > 1 && numSegments > 1) {
+            std::atomic<int> next(0);
+            pool->run([&](int tid, int nthreads) {
+                for (int sg = next++; sg < numSegments; sg = next++) {
+                    backwardSegment(sg, input, foreground, learningRate, state);
+                }
+            }, numSegments);
+        } else {
+            for (int sg = 0; sg < numSegments; sg++) {
+                backwardSegment(sg, input, foreground, learningRate, state);
+            }
+        }
+    }
+
+    /* *************************************************************** */
+    /* Greedy local-loss training. Each segment is trained on the sample as
+       soon as its own output is available: the last layer of the segment
+       is compared with the target (a layer of another width through the
+       transposed remap, so dE_dY = R 2 (R^T Y - target)), the error goes
+       back through the segment's layers only, and the output of the
+       segment is the input of the next one. Only the layers of one
+       segment hold activations at a time, they share localState, which
+       keeps the working set to the longest segment instead of the whole
+       stack. Returns the network output, overwritten by the next call. */
+    const std::vector<float>& trainLocal(const std::vector<float> &input, const std::vector<int> &foreground, const std::vector<float> &target, float learningRate) {
+        return trainLocal(input, &foreground, target, learningRate);
+    }
+
+    // foreground is nullptr for a dense input
+    const std::vector<float>& trainLocal(const std::vector<float> &input, const std::vector<int> *foreground, const std::vector<float> &target, float learningRate) {
+        LayerState* out = nullptr;
+        for (int sg = 0; sg < segment.size(); sg++) {
+            int startLayer = segment[sg].first;
+            int endLayer = segment[sg].second;
+            if (sg > 0) {
+                // The slot of the previous output is reused by this segment
+                localInput.assign(out->Y.begin(), out->Y.end());
+            }
+            const std::vector<float>& X = (sg > 0) ? localInput : input;
+
+            for (int L = startLayer; L <= endLayer; L++) {
+                LayerState& ls = localState[L - startLayer];
+                ls.resize((int)layer[L]->Nx, (int)layer[L]->Ny);
+                if (L > startLayer) {
+                    layer[L]->eval(localState[L - startLayer - 1].Y, ls);
+                } else if (L == 0 && foreground != nullptr) {
+                    layer[0]->evalForeground(X, *foreground, ls);
                 } else {
-                    for (int i = 0; i < dOut.size(); i++) {
-                        dEVar[i % dEVar.size()] += dOut[i];
-                    }
+                    layer[L]->eval(X, ls);
                 }
-                dE = &dEVar;
             }
-            
-            for (int L = endLayer; L>= startLayer; L--) {
-                dE = layer[L]->updateWeights((L > 0)? layer[L - 1]->Y : input, learningRate, *dE);
+
+            out = &localState[endLayer - startLayer];
+            const FeedbackRemap& map = localRemap[sg];
+            if (map.rowStart.empty()) {
+                for (int i = 0; i < target.size(); i++) {
+                    out->dE_dY[i] = 2.0 * (out->Y[i] - target[i]);
+                }
+            } else {
+                const FeedbackRemap& back = remap[sg];
+                localError.resize(target.size());
+                Kernels::get().spmv((int)target.size(), map.rowStart.data(), map.column.data(), map.values.data(), out->Y.data(), localError.data());
+                for (int i = 0; i < target.size(); i++) {
+                    localError[i] = 2.0 * (localError[i] - target[i]);
+                }
+                Kernels::get().spmv((int)out->dE_dY.size(), back.rowStart.data(), back.column.data(), back.values.data(), localError.data(), out->dE_dY.data());
+            }
+
+            std::vector<float> *dE = &out->dE_dY;
+            for (int L = endLayer; L >= startLayer; L--) {
+                LayerState& ls = localState[L - startLayer];
+                if (L == 0 && foreground != nullptr) {
+                    layer[0]->updateWeightsForeground(X, *foreground, learningRate, *dE, ls);
+                } else {
+                    dE = layer[L]->updateWeights((L > startLayer) ? localState[L - startLayer - 1].Y : X, learningRate, *dE, ls);
+                }
+            }
+        }
+        return out->Y;
+    }
+
+    /* *************************************************************** */
+    /* Pipelined training. Every pool thread owns a run of consecutive
+       segments. For each sample it runs the forward pass of its segments
+       once the previous thread has passed the sample on, waits for the
+       output error, and updates its segments. The forward pass of the
+       next sample through a segment follows the update of that segment,
+       while later segments are still updating the previous sample, so
+       the result is the same as the serial loop. Two workspaces
+       alternate between consecutive samples. The pipeline takes at most
+       one thread per segment, so the calling thread always owns segment
+       0: fetch(i, input, foreground, target) fills the buffers of sample
+       i and is only called from the calling thread. */
+    template <typename F>
+    TrainStats trainPipelined(int numSamples, float learningRate, F&& fetch) {
+        int numSegments = (int)segment.size();
+        if (pipelineSlots.empty()) {
+            for (int b = 0; b < 2; b++) {
+                pipelineSlots.push_back(PipelineSlot{createWorkspace(), {}, {}, {}});
+                pipelineSlots[b].input.reserve((int)layer[0]->Nx);
+                pipelineSlots[b].foreground.reserve((int)layer[0]->Nx);
             }
-            startLayer = endLayer + 1;
-            endIt++;
         }
+        for (int sg = 0; sg < numSegments; sg++) {
+            segmentDone[sg].store(-1);
+        }
+        outputDone.store(-1);
+        TrainStats stats{0.0, 0};
 
+        auto stage = [&](int tid, int nthreads) {
+            int first, last;
+            ThreadPool::split(0, numSegments, 1, tid, nthreads, first, last);
+            if (first >= last) {
+                return;
+            }
+            for (int i = 0; i < numSamples; ++i) {
+                PipelineSlot& slot = pipelineSlots[i % 2];
+                if (first == 0) {
+                    fetch(i, slot.input, slot.foreground, slot.target);
+                }
+                for (int sg = first; sg < last; sg++) {
+                    if (sg > 0) {
+                        waitFor(segmentDone[sg - 1], i);
+                    }
+                    forwardSegment(sg, slot.input, &slot.foreground, slot.ws);
+                    segmentDone[sg].store(i, std::memory_order_release);
+                }
+
+                if (last == numSegments) {
+                    const std::vector<float>& output = slot.ws.back().Y;
+                    std::vector<float>& dOut = slot.ws.back().dE_dY;
+                    const std::vector<float>& target = slot.target;
+                    int predicted = (int)std::distance(output.begin(), std::max_element(output.begin(), output.end()));
+                    int expected = (int)std::distance(target.begin(), std::max_element(target.begin(), target.end()));
+                    if (predicted == expected) {
+                        stats.correct++;
+                    }
+                    for (int k = 0; k < output.size(); ++k) {
+                        stats.loss += 0.5 * (target[k] - output[k]) * (target[k] - output[k]);
+                        dOut[k] = 2.0 * (output[k] - target[k]);
+                    }
+                    outputDone.store(i, std::memory_order_release);
+                } else {
+                    waitFor(outputDone, i);
+                }
+
+                for (int sg = first; sg < last; sg++) {
+                    backwardSegment(sg, slot.input, &slot.foreground, learningRate, slot.ws);
+                }
+            }
+        };
+        if (pool != nullptr) {
+            pool->run(stage, numSegments);
+        } else {
+            stage(0, 1);
+        }
+        return stats;
     }
 
     void backward(const std::vector<float> &input, const std::vector<float> &target, float learningRate) {
-        std::vector<float>& output =  layer[layer.size() - 1]->Y;
-        std::vector<float> dOut(output.size());
+        backward(input, target, learningRate, state);
+    }
+
+    void backward(const std::vector<float> &input, const std::vector<float> &target, float learningRate, Workspace &ws) {
+        std::vector<float>& output =  ws.back().Y;
+        std::vector<float>& dOut = ws.back().dE_dY;
         std::vector<float> *dE;
         
         // calculate Output error derivative
@@ -101,18 +331,119 @@ public:
         dE = &dOut;
         
         for (int L = (int)layer.size() - 1; L > 0; L--){
-            dE = layer[L]->updateWeights(layer[L - 1]->Y, learningRate, *dE);
+            dE = layer[L]->updateWeights(ws[L - 1].Y, learningRate, *dE, ws[L]);
         }
-        layer[0]->updateWeights(input, learningRate, *dE);
+        layer[0]->updateWeights(input, learningRate, *dE, ws[0]);
         
     }
 
-    ~NeuralNetwork() {
+    /* *************************************************************** */
+    /* Hogwild training: the samples are split in one contiguous shard per
+       pool thread, each thread runs forward/backward with its own Workspace
+       and updates the shared weights without locks. Overlapping updates
+       can overwrite each other, which sparse-gradient SGD tolerates.
+       fetch(i, input, target) fills the buffers of sample i and is called
+       from several threads at once. */
+    template <typename F>
+    TrainStats trainHogwild(int numSamples, float learningRate, F&& fetch) {
+        int numThreads = (pool != nullptr) ? pool->size() : 1;
+        while (hogwild.size() < numThreads) {
+            hogwild.push_back(HogwildShard{createWorkspace(), {}, {}, {0.0, 0}});
+        }
+        // the shards share the weights, the first layer must not fold its
+        // background shift from several threads
+        layer[0]->syncDense();
+
+        auto shard = [&](int tid, int nthreads) {
+            Workspace& ws = hogwild[tid].ws;
+            std::vector<float>& input = hogwild[tid].input;
+            std::vector<float>& target = hogwild[tid].target;
+            TrainStats& partial = hogwild[tid].stats;
+            partial = TrainStats{0.0, 0};
+            int from, to;
+            ThreadPool::split(0, numSamples, 1, tid, nthreads, from, to);
+            for (int i = from; i < to; ++i) {
+                fetch(i, input, target);
+                const std::vector<float>& output = forward(input, ws);
+                int predicted = (int)std::distance(output.begin(), std::max_element(output.begin(), output.end()));
+                int expected = (int)std::distance(target.begin(), std::max_element(target.begin(), target.end()));
+                if (predicted == expected) {
+                    partial.correct++;
+                }
+                for (int k = 0; k < output.size(); ++k) {
+                    partial.loss += 0.5 * (target[k] - output[k]) * (target[k] - output[k]);
+                }
+                backward(input, target, learningRate, ws);
+            }
+        };
+        if (pool != nullptr) {
+            pool->run(shard);
+        } else {
+            shard(0, 1);
+        }
+
+        TrainStats total{0.0, 0};
+        for (int t = 0; t < numThreads; t++) {
+            total.loss += hogwild[t].stats.loss;
+            total.correct += hogwild[t].stats.correct;
+        }
+        return total;
+    }
+
+    /* *************************************************************** */
+    /* Mini-batch training, input is count x numOfInputs and target is
+       count x outputs, both row-major */
+    const std::vector<float>& forwardBatch(const std::vector<float> &input, int count) {
+        layer[0]->evalBatch(input.data(), count, state[0]);
+        for (int L = 1; L < layer.size(); L++) {
+            layer[L]->evalBatch(state[L - 1].Yb.data(), count, state[L]);
+        }
+
+        return state.back().Yb;
+    }
+
+    void backwardBatch(const std::vector<float> &input, const std::vector<float> &target, int count, float learningRate) {
+        std::vector<float>& output = state.back().Yb;
+        dOutBatch.resize((size_t)count * (int)layer.back()->Ny);
+        const float *dE;
+
+        // calculate Output error derivative
+        for (size_t i = 0; i < dOutBatch.size(); i++) {
+            dOutBatch[i] = 2.0 * (output[i] - target[i]);
+        }
+        dE = dOutBatch.data();
+
+        for (int L = (int)layer.size() - 1; L > 0; L--){
+            dE = layer[L]->updateWeightsBatch(state[L - 1].Yb.data(), count, learningRate, dE, state[L]);
+        }
+        layer[0]->updateWeightsBatch(input.data(), count, learningRate, dE, state[0]);
+    }
+
+    ~NeuralNetworkT() {
         for (Layer* ilayer : layer) {
             delete ilayer;
         }
+        delete pool;
+    }
+
+    // Splits every layer across numThreads threads (including the caller),
+    // the workers are created here once and reused for every call
+    void setThreads(int numThreads) {
+        delete pool;
+        pool = (numThreads > 1) ? new ThreadPool(numThreads) : nullptr;
+        for (int L = 0; L < layer.size(); L++) {
+            layer[L]->pool = pool;
+        }
     }
     
+    Activation* getActivation() const {
+        return activeFunction;
+    }
+
+    ThreadPool* getPool() const {
+        return pool;
+    }
+
     void setFastMode(bool fast) {
         for (int L = 0; L < layer.size(); L++) {
             layer[L]->fast = fast;
@@ -122,22 +453,133 @@ public:
     void printGradients() {
         for (int L = 0; L < layer.size(); L++) {
             std::cout <<"Layer " << L << std::endl;
-            for(int g = 0; g < layer[L]->dE_dX.size(); g++) {
-                std::cout << std::fixed << std::setw(11) << std::setprecision(6) << layer[L]->dE_dX[g] <<", ";
+            for(int g = 0; g < state[L].dE_dX.size(); g++) {
+                std::cout << std::fixed << std::setw(11) << std::setprecision(6) << state[L].dE_dX[g] <<", ";
             }
             std::cout << std::endl;
         }
     }
     
-    void saveWeights(std::string filename) {
+    /* *************************************************************** */
+    /* Magnitude pruning, every node keeps its largest (1 - sparsity) * Nx
+       weights. Training afterwards fine-tunes the kept weights. Both
+       return the fraction of the weights that was dropped. */
+    float prune(float sparsity) {
+        size_t kept = 0, total = 0;
+        for (int L = 0; L < layer.size(); L++) {
+            int nx = (int)layer[L]->Nx;
+            int k = std::max(1, (int)std::lround((1.0f - sparsity) * nx));
+            kept += layer[L]->pruneTopK(std::min(k, nx));
+            total += (size_t)nx * (int)layer[L]->Ny;
+        }
+        return 1.0f - (float)kept / total;
+    }
+
+    float pruneBelow(float threshold) {
+        size_t kept = 0, total = 0;
+        for (int L = 0; L < layer.size(); L++) {
+            kept += layer[L]->pruneBelow(threshold);
+            total += (size_t)(int)layer[L]->Nx * (int)layer[L]->Ny;
+        }
+        return 1.0f - (float)kept / total;
+    }
+
+    /* *************************************************************** */
+    /* Binary checkpoint, see Checkpoint.h for the layout */
+    bool saveWeights(const std::string& filename) {
+        std::vector<char> image;
+        snapshotWeights(image);
+        if (!writeCheckpointFile(filename, filename + ".tmp", image.data(), image.size())) {
+            std::cerr << "Unable to write file " << filename << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Copies the whole checkpoint file into image, which keeps its capacity
+    // between calls. This is the only part that needs the weights to hold
+    // still, the image can then be written out from another thread.
+    void snapshotWeights(std::vector<char>& image) {
+        uint64_t fileSize = checkpointTable();
+        image.resize(fileSize);
+        CheckpointHeader header = {};
+        std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+        header.version = CHECKPOINT_VERSION;
+        header.activation = activeFunction->getType();
+        header.numInputs = (uint32_t)layer[0]->Nx;
+        header.numLayers = (uint32_t)layer.size();
+        header.nodeParams = 1;
+
+        char* out = image.data();
+        size_t tableBytes = checkpointLayers.size() * sizeof(CheckpointLayer);
+        std::memcpy(out, &header, sizeof(header));
+        std::memcpy(out + sizeof(header), checkpointLayers.data(), tableBytes);
+        std::memset(out + sizeof(header) + tableBytes, 0, checkpointAlign(tableBytes) - tableBytes);
+        for (int L = 0; L < layer.size(); L++) {
+            const CheckpointLayer& entry = checkpointLayers[L];
+            size_t blockBytes = entry.size * sizeof(float);
+            layer[L]->syncDense();
+            std::memcpy(out + entry.offset, layer[L]->W, blockBytes);
+            std::memset(out + entry.offset + blockBytes, 0, checkpointAlign(blockBytes) - blockBytes);
+        }
+    }
+
+    // Maps a checkpoint written by saveWeights and points the layers at its
+    // parameter blocks, so inference runs straight from the page cache. The
+    // mapping is copy-on-write, training can go on without touching the file.
+    // The topology and activation must match this network.
+    bool loadWeights(const std::string& filename) {
+        MappedFile file;
+        if (!file.open(filename, true)) {
+            std::cerr << "Unable to open file " << filename << std::endl;
+            return false;
+        }
+        const char* error = checkpointError(file.data, file.length);
+        if (error != nullptr) {
+            std::cerr << error << " " << filename << std::endl;
+            return false;
+        }
+        const CheckpointHeader* header = reinterpret_cast<const CheckpointHeader*>(file.data);
+        uint64_t fileSize = checkpointTable();
+        const std::vector<CheckpointLayer>& table = checkpointLayers;
+        if (header->activation != (uint32_t)activeFunction->getType() || header->numInputs != (uint32_t)layer[0]->Nx
+            || header->numLayers != (uint32_t)layer.size() || header->nodeParams != 1) {
+            std::cerr << "Checkpoint file " << filename << " does not match the network" << std::endl;
+            return false;
+        }
+        if (file.length < fileSize) {
+            std::cerr << "Truncated checkpoint file " << filename << std::endl;
+            return false;
+        }
+        const CheckpointLayer* stored = reinterpret_cast<const CheckpointLayer*>(file.data + sizeof(CheckpointHeader));
+        for (int L = 0; L < layer.size(); L++) {
+            if (stored[L].numInputs != table[L].numInputs || stored[L].numOutputs != table[L].numOutputs
+                || stored[L].stride != table[L].stride || stored[L].offset != table[L].offset || stored[L].size != table[L].size) {
+                std::cerr << "Checkpoint file " << filename << " does not match the network (layer " << L << ")" << std::endl;
+                return false;
+            }
+        }
+
+        for (int L = 0; L < layer.size(); L++) {
+            layer[L]->attach(reinterpret_cast<float*>(file.data + table[L].offset));
+        }
+        // The previous mapping, if any, is released when file goes out of scope
+        checkpoint.swap(file);
+        return true;
+    }
+
+    // Text dump for reading the weights, one line per node: theta then the weights
+    void dumpWeights(std::string filename) {
         std::ofstream file;
         file.open (filename);
         for (int L = 0; L < layer.size(); L++) {
+            layer[L]->syncDense();
             file << "Layer " << L << std::endl;
-            for(int n = 0; n < layer[L]->node.size(); n++) {
-                file << layer[L]->node[n].theta;
-                for(int w = 0; w < layer[L]->node[n].W.size(); w++) {
-                    file << "," << layer[L]->node[n].W[w];
+            for(int n = 0; n < (int)layer[L]->Ny; n++) {
+                const float* W = layer[L]->row(n);
+                file << layer[L]->theta[n];
+                for(int w = 0; w < (int)layer[L]->Nx; w++) {
+                    file << "," << W[w];
                 }
                 file << std::endl;
             }
@@ -148,11 +590,133 @@ public:
 
 
 private:
+    // Runs the layers of segment sg on ws, input feeds layer 0
+    void forwardSegment(int sg, const std::vector<float> &input, const std::vector<int> *foreground, Workspace &ws) {
+        for (int L = segment[sg].first; L <= segment[sg].second; L++) {
+            if (L > 0) {
+                layer[L]->eval(ws[L - 1].Y, ws[L]);
+            } else if (foreground != nullptr) {
+                layer[0]->evalForeground(input, *foreground, ws[0]);
+            } else {
+                layer[0]->eval(input, ws[0]);
+            }
+        }
+    }
+
+    // Updates the layers of segment sg from the output error in ws.back().dE_dY
+    void backwardSegment(int sg, const std::vector<float> &input, const std::vector<int> *foreground, float learningRate, Workspace &ws) {
+        int startLayer = segment[sg].first;
+        int endLayer = segment[sg].second;
+        std::vector<float>& dOut = ws.back().dE_dY;
+        std::vector<float> *dE = &dOut;
+
+        // Adapt error derivative to destination size
+        const FeedbackRemap& map = remap[sg];
+        if (!map.rowStart.empty()) {
+            std::vector<float>& dEVar = ws[endLayer].dE_dY;
+            Kernels::get().spmv((int)dEVar.size(), map.rowStart.data(), map.column.data(), map.values.data(), dOut.data(), dEVar.data());
+            dE = &dEVar;
+        }
+        
+        for (int L = endLayer; L>= startLayer; L--) {
+            if (L == 0 && foreground != nullptr) {
+                layer[0]->updateWeightsForeground(input, *foreground, learningRate, *dE, ws[0]);
+            } else {
+                dE = layer[L]->updateWeights((L > 0)? ws[L - 1].Y : input, learningRate, *dE, ws[L]);
+            }
+        }
+    }
+
+    // Splits the layers at the feedback set, each segment ends at a feedback layer
+    void buildSegments() {
+        segment.clear();
+        std::set<int>::iterator endIt = feedback.begin();
+        int startLayer = *endIt;
+        for (endIt++; endIt != feedback.end(); endIt++) {
+            segment.push_back(std::make_pair(startLayer, *endIt));
+            startLayer = *endIt + 1;
+        }
+        segmentDone = std::vector<std::atomic<int>>(segment.size());
+
+        // The output error reaches a feedback layer of another width through
+        // remap, the local loss of trainLocal compares its output with the
+        // target through the transposed map
+        int No = layer.back()->Ny;
+        remap.assign(segment.size(), FeedbackRemap());
+        localRemap.assign(segment.size(), FeedbackRemap());
+        int longest = 0;
+        for (int sg = 0; sg < segment.size(); sg++) {
+            int Ny = layer[segment[sg].second]->Ny;
+            if (Ny != No) {
+                remap[sg] = widthMap(Ny, No);
+                localRemap[sg] = widthMap(No, Ny);
+            }
+            longest = std::max(longest, segment[sg].second - segment[sg].first + 1);
+        }
+        localState.resize(longest);
+    }
+
+    // The 0/1 matrix in CSR form that takes a vector of cols values to rows
+    // values: more rows repeat the vector (row r reads r % cols), fewer
+    // fold it (row r sums r, r + rows, r + 2 rows, ...)
+    static FeedbackRemap widthMap(int rows, int cols) {
+        FeedbackRemap map;
+        map.rowStart.assign(1, 0);
+        for (int r = 0; r < rows; r++) {
+            if (rows > cols) {
+                map.column.push_back(r % cols);
+            } else {
+                for (int i = r; i < cols; i += rows) {
+                    map.column.push_back(i);
+                }
+            }
+            map.rowStart.push_back((int)map.column.size());
+        }
+        map.values.assign(map.column.size(), 1.0f);
+        return map;
+    }
+
+    static void waitFor(const std::atomic<int>& progress, int sample) {
+        while (progress.load(std::memory_order_acquire) < sample) {
+            std::this_thread::yield();
+        }
+    }
+
+    // Fills checkpointLayers for the current topology and returns the file size
+    uint64_t checkpointTable() {
+        checkpointLayers.resize(layer.size());
+        for (int L = 0; L < layer.size(); L++) {
+            checkpointLayers[L].numInputs = (uint32_t)layer[L]->Nx;
+            checkpointLayers[L].numOutputs = (uint32_t)layer[L]->Ny;
+            checkpointLayers[L].stride = (uint32_t)layer[L]->stride;
+            checkpointLayers[L].reserved = 0;
+            checkpointLayers[L].size = layer[L]->blockSize();
+        }
+        return checkpointLayout(checkpointLayers);
+    }
+
     std::vector<Layer*> layer;
+    ThreadPool* pool;
+    Workspace state;
+    std::vector<HogwildShard> hogwild;
+    std::vector<float> dOutBatch;
     std::set<int> feedback;
-    AFunction* activeFunction;
+    std::vector<std::pair<int, int>> segment;   // first and last layer of each segment
+    std::vector<PipelineSlot> pipelineSlots;
+    std::vector<FeedbackRemap> remap;           // output error to the last layer of each segment, empty if the widths match
+    std::vector<FeedbackRemap> localRemap;      // last layer of each segment to the target, for trainLocal
+    Workspace localState;                       // layers of the segment trainLocal is on
+    std::vector<float> localInput;
+    std::vector<float> localError;
+    std::vector<std::atomic<int>> segmentDone;  // last sample through each segment's forward pass
+    std::atomic<int> outputDone;
+    Activation* activeFunction;
+    MappedFile checkpoint;  // weights of the last loadWeights
+    std::vector<CheckpointLayer> checkpointLayers;
 };
 
+typedef NeuralNetworkT<AFunction> NeuralNetwork;
+
 
 
 #endif /* NeuralNetwork_h */
@@ -0,0 +1,206 @@
+//
+//  ThreadPool.h
+//  Mnist_Multi_Layers
+//
+//  Persistent worker threads for splitting a layer across cores.
+//  The calling thread takes part as thread 0 and run() only returns
+//  when every thread has finished, so each call is a barrier.
+//
+
+#ifndef ThreadPool_h
+#define ThreadPool_h
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdlib>
+#include <type_traits>
+
+
+class ThreadPool {
+public:
+    ThreadPool(int numThreads) {
+        numOfThreads = (numThreads < 1) ? 1 : numThreads;
+        job = nullptr;
+        jobContext = nullptr;
+        generation = 0;
+        active = 0;
+        nextTid = 0;
+        pending = 0;
+        stop = false;
+        for (int t = 1; t < numOfThreads; t++) {
+            workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stop = true;
+            generation++;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    int size() const {
+        return numOfThreads;
+    }
+
+    // Threads asked for with ANN_THREADS=n, 0 for every hardware thread.
+    // Without it the networks run on the calling thread only.
+    static int requestedThreads() {
+        const char* env = std::getenv("ANN_THREADS");
+        if (env == nullptr) {
+            return 1;
+        }
+        int n = std::atoi(env);
+        if (n == 0) {
+            n = (int)std::thread::hardware_concurrency();
+        }
+        return (n < 1) ? 1 : n;
+    }
+
+    // Calls task(tid, nthreads) once on each of the first maxThreads
+    // threads (all of them by default), only those workers are woken.
+    // A call made from inside a task runs on the calling thread only.
+    template <typename F>
+    void run(F&& task, int maxThreads = 0) {
+        int n = (maxThreads < 1 || maxThreads > numOfThreads) ? numOfThreads : maxThreads;
+        if (n == 1 || insideTask()) {
+            task(0, 1);
+            return;
+        }
+        typedef typename std::remove_reference<F>::type Task;
+        dispatch(&invoke<Task>, (void*)&task, n);
+    }
+
+    // Splits [begin, end) in contiguous ranges, one per thread, each range
+    // boundary a multiple of grain so threads don't share cache lines.
+    // No more threads than blocks of grain, and at most maxThreads.
+    template <typename F>
+    void parallelFor(int begin, int end, int grain, F&& body, int maxThreads = 0) {
+        int blocks = (end - begin + grain - 1) / grain;
+        if (maxThreads < 1 || maxThreads > blocks) {
+            maxThreads = blocks;
+        }
+        run([&](int tid, int nthreads) {
+            int from, to;
+            split(begin, end, grain, tid, nthreads, from, to);
+            if (from < to) {
+                body(from, to);
+            }
+        }, maxThreads);
+    }
+
+    static void split(int begin, int end, int grain, int tid, int nthreads, int& from, int& to) {
+        int blocks = (end - begin + grain - 1) / grain;
+        int first = (int)((long long)blocks * tid / nthreads);
+        int last = (int)((long long)blocks * (tid + 1) / nthreads);
+        from = begin + first * grain;
+        to = begin + last * grain;
+        if (from > end) {
+            from = end;
+        }
+        if (to > end) {
+            to = end;
+        }
+    }
+
+private:
+    typedef void (*Job)(void* context, int tid, int nthreads);
+
+    template <typename F>
+    static void invoke(void* context, int tid, int nthreads) {
+        (*static_cast<F*>(context))(tid, nthreads);
+    }
+
+    static bool& insideTask() {
+        static thread_local bool inside = false;
+        return inside;
+    }
+
+    // The workers take the thread ids 1 to n - 1 in the order they wake,
+    // one that comes later finds none left and goes back to sleep
+    void dispatch(Job task, void* context, int n) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            job = task;
+            jobContext = context;
+            active = n;
+            nextTid = 1;
+            pending.store(n - 1);
+            generation++;
+        }
+        if (n == numOfThreads) {
+            wake.notify_all();
+        } else {
+            for (int t = 1; t < n; t++) {
+                wake.notify_one();
+            }
+        }
+        insideTask() = true;
+        task(context, 0, n);
+        insideTask() = false;
+        // Workers are usually done within microseconds, spin before sleeping
+        for (int spin = 0; pending.load(std::memory_order_acquire) != 0; spin++) {
+            if (spin < 4096) {
+                std::this_thread::yield();
+            } else {
+                std::unique_lock<std::mutex> lock(mtx);
+                done.wait(lock, [this] { return pending.load() == 0; });
+            }
+        }
+    }
+
+    void workerLoop() {
+        insideTask() = true;
+        int seen = 0;
+        while (true) {
+            Job task;
+            void* context;
+            int tid;
+            int n;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                wake.wait(lock, [&] { return generation != seen; });
+                seen = generation;
+                if (stop) {
+                    return;
+                }
+                if (nextTid >= active) {
+                    continue;
+                }
+                tid = nextTid++;
+                n = active;
+                task = job;
+                context = jobContext;
+            }
+            task(context, tid, n);
+            if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                std::lock_guard<std::mutex> lock(mtx);
+                done.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mtx;
+    std::condition_variable wake;
+    std::condition_variable done;
+    Job job;
+    void* jobContext;
+    int generation;
+    int active;             // threads of the current call, the caller included
+    int nextTid;
+    std::atomic<int> pending;
+    bool stop;
+    int numOfThreads;
+};
+
+
+#endif /* ThreadPool_h */
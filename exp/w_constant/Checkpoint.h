@@ -0,0 +1,121 @@
+//
+//  Checkpoint.h
+//  Mnist_Multi_Layers
+//
+//  Binary model file written by NeuralNetwork::saveWeights. Every part
+//  starts on a 64 byte boundary, so the layers can use the parameter
+//  blocks of a mapped file in place:
+//    CheckpointHeader                          64 bytes
+//    one CheckpointLayer per layer             32 bytes each, padded to 64
+//    the parameter block of every layer        Layer::blockSize() floats
+//  Values are stored in the byte order of the machine that wrote them.
+//
+
+#ifndef Checkpoint_h
+#define Checkpoint_h
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+const char CHECKPOINT_MAGIC[8] = {'A', 'N', 'N', 'C', 'K', 'P', 'T', '\0'};
+const uint32_t CHECKPOINT_VERSION = 1;
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t activation;    // AFunction::Type
+    uint32_t numInputs;
+    uint32_t numLayers;
+    uint32_t nodeParams;    // per-node vectors after W, 1 for theta, 2 for alpha and beta
+    uint32_t reserved[9];
+};
+
+struct CheckpointLayer {
+    uint32_t numInputs;
+    uint32_t numOutputs;
+    uint32_t stride;        // floats per row of W
+    uint32_t reserved;
+    uint64_t offset;        // bytes from the start of the file to the parameter block
+    uint64_t size;          // floats in the parameter block
+};
+
+static_assert(sizeof(CheckpointHeader) == 64, "CheckpointHeader must be 64 bytes");
+static_assert(sizeof(CheckpointLayer) == 32, "CheckpointLayer must be 32 bytes");
+
+inline uint64_t checkpointAlign(uint64_t bytes) {
+    return (bytes + 63) & ~(uint64_t)63;
+}
+
+// Fills in the offsets of table, whose sizes are already set, and returns the file size
+inline uint64_t checkpointLayout(std::vector<CheckpointLayer>& table) {
+    uint64_t offset = sizeof(CheckpointHeader) + checkpointAlign(table.size() * sizeof(CheckpointLayer));
+    for (CheckpointLayer& entry : table) {
+        entry.offset = offset;
+        offset += checkpointAlign(entry.size * sizeof(float));
+    }
+    return offset;
+}
+
+// Checks the header and that the layer table describes a chain of layers
+// whose blocks lie inside the data. Returns an error message or nullptr.
+inline const char* checkpointError(const uint8_t* data, size_t size) {
+    const CheckpointHeader* header = reinterpret_cast<const CheckpointHeader*>(data);
+    if (size < sizeof(CheckpointHeader) || std::memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0) {
+        return "Invalid checkpoint file";
+    }
+    if (header->version != CHECKPOINT_VERSION) {
+        return "Unsupported checkpoint version";
+    }
+    if (header->numLayers == 0 || (header->nodeParams != 1 && header->nodeParams != 2)) {
+        return "Invalid checkpoint file";
+    }
+    if (size < sizeof(CheckpointHeader) + (uint64_t)header->numLayers * sizeof(CheckpointLayer)) {
+        return "Truncated checkpoint file";
+    }
+    const CheckpointLayer* table = reinterpret_cast<const CheckpointLayer*>(data + sizeof(CheckpointHeader));
+    uint32_t numInputs = header->numInputs;
+    for (uint32_t L = 0; L < header->numLayers; L++) {
+        const CheckpointLayer& entry = table[L];
+        uint64_t padded = (entry.numOutputs + 15) & ~15u;
+        if (entry.numInputs != numInputs || entry.stride < entry.numInputs || entry.stride % 16 != 0 || entry.offset % 64 != 0
+            || entry.size != (uint64_t)entry.numOutputs * entry.stride + header->nodeParams * padded) {
+            return "Invalid checkpoint layer table";
+        }
+        if (entry.offset + entry.size * sizeof(float) > size) {
+            return "Truncated checkpoint file";
+        }
+        numInputs = entry.numOutputs;
+    }
+    return nullptr;
+}
+
+// Writes data to tmpPath and renames it over path, so path always holds a
+// complete checkpoint even if the process dies halfway through a write
+inline bool writeCheckpointFile(const std::string& path, const std::string& tmpPath, const char* data, size_t size) {
+    int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t count = ::write(fd, data + done, size - done);
+        if (count <= 0) {
+            ::close(fd);
+            return false;
+        }
+        done += (size_t)count;
+    }
+    bool ok = (fsync(fd) == 0);
+    ok = (::close(fd) == 0) && ok;
+    return ok && std::rename(tmpPath.c_str(), path.c_str()) == 0;
+}
+
+
+#endif /* Checkpoint_h */
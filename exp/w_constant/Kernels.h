@@ -0,0 +1,1426 @@
+//
+//  Kernels.h
+//  Mnist_Multi_Layers
+//
+//  Vector kernels used by the layers. The widest instruction set the
+//  CPU supports is picked once at runtime, the scalar versions are the
+//  portable fallback. ANN_KERNEL=scalar|avx2|avx512 forces a version.
+//
+
+#ifndef Kernels_h
+#define Kernels_h
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ANN_X86 1
+#include <immintrin.h>
+#endif
+
+
+/* *************************************************************** */
+/* Portable versions */
+inline float dotScalar(const float* a, const float* b, int n) {
+    float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 += a[i] * b[i];
+        s1 += a[i + 1] * b[i + 1];
+        s2 += a[i + 2] * b[i + 2];
+        s3 += a[i + 3] * b[i + 3];
+    }
+    for (; i < n; ++i) {
+        s0 += a[i] * b[i];
+    }
+    return (s0 + s1) + (s2 + s3);
+}
+
+// y[n] = W[n,:] . x for the N rows of W
+inline void matvecScalar(int N, int K, const float* W, int ldw, const float* x, float* y) {
+    for (int n = 0; n < N; ++n) {
+        y[n] = dotScalar(W + (size_t)n * ldw, x, K);
+    }
+}
+
+// y += a * x
+inline void axpyScalar(float a, const float* x, float* y, int n) {
+    for (int i = 0; i < n; ++i) {
+        y[i] += a * x[i];
+    }
+}
+
+// dx += g * w, then w += step * x, one pass over the row
+inline void backpropRowScalar(float g, float step, const float* x, float* w, float* dx, int n) {
+    for (int i = 0; i < n; ++i) {
+        float wi = w[i];
+        dx[i] += g * wi;
+        w[i] = wi + step * x[i];
+    }
+}
+
+
+/* *************************************************************** */
+/* Matrix products for mini-batches, all row-major with leading dimensions.
+   gemmNT: C[M x N]  = A[M x K] * B[N x K]^T   (batch x weights^T)
+   gemmNN: C[M x K]  = A[M x N] * B[N x K]     (gradients x weights)
+   gemmTN: C[N x K] += A[M x N]^T * B[M x K]   (weight gradient accumulation) */
+inline void gemmNTScalar(int M, int N, int K, const float* A, int lda, const float* B, int ldb, float* C, int ldc) {
+    for (int m = 0; m < M; ++m) {
+        for (int n = 0; n < N; ++n) {
+            C[(size_t)m * ldc + n] = dotScalar(A + (size_t)m * lda, B + (size_t)n * ldb, K);
+        }
+    }
+}
+
+inline void gemmNNScalar(int M, int N, int K, const float* A, int lda, const float* B, int ldb, float* C, int ldc) {
+    for (int m = 0; m < M; ++m) {
+        float* c = C + (size_t)m * ldc;
+        for (int k = 0; k < K; ++k) {
+            c[k] = 0.0f;
+        }
+        for (int n = 0; n < N; ++n) {
+            axpyScalar(A[(size_t)m * lda + n], B + (size_t)n * ldb, c, K);
+        }
+    }
+}
+
+inline void gemmTNScalar(int M, int N, int K, const float* A, int lda, const float* B, int ldb, float* C, int ldc) {
+    for (int n = 0; n < N; ++n) {
+        float* c = C + (size_t)n * ldc;
+        for (int m = 0; m < M; ++m) {
+            axpyScalar(A[(size_t)m * lda + n], B + (size_t)m * ldb, c, K);
+        }
+    }
+}
+
+
+/* *************************************************************** */
+/* Polynomial approximations for the activations, used in the Fast
+   precision mode. Maximum error against the double precision libm
+   result, measured over the stated ranges:
+     expApprox    relative 8.4e-8       x in [-87, 88], clamped outside
+     tanhApprox   absolute 9.0e-8       all x
+     sinApprox    absolute 9.3e-8       |x| < 1e5, grows with |x| beyond
+     cosApprox    absolute 9.3e-8       |x| < 1e5, grows with |x| beyond
+   The constants are the Cephes single precision ones. */
+inline float expApprox(float x) {
+    x = (x < -87.0f) ? -87.0f : ((x > 88.0f) ? 88.0f : x);
+    float k = std::rint(x * 1.44269504088896341f);
+    float r = x - k * 0.693359375f;
+    r = r - k * -2.12194440e-4f;
+    float p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    float y = p * r * r + r + 1.0f;
+    int32_t bits = ((int32_t)k + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return y * scale;
+}
+
+inline float tanhApprox(float x) {
+    float a = std::fabs(x);
+    if (a < 0.625f) {
+        float z = x * x;
+        float p = -5.70498872745e-3f;
+        p = p * z + 2.06390887954e-2f;
+        p = p * z - 5.37397155531e-2f;
+        p = p * z + 1.33314422036e-1f;
+        p = p * z - 3.33332819422e-1f;
+        return p * z * x + x;
+    }
+    float t = expApprox(-2.0f * a);
+    float y = (1.0f - t) / (1.0f + t);
+    return (x < 0.0f) ? -y : y;
+}
+
+// sin(x + quadrant * pi/2), the argument is reduced to [-pi/4, pi/4]
+inline float sinQuadrantApprox(float x, int quadrant) {
+    float k = std::rint(x * 0.636619772367581343f);
+    float r = x - k * 1.5703125f;
+    r = r - k * 4.837512969970703125e-4f;
+    r = r - k * 7.54978995489188216e-8f;
+    float z = r * r;
+    float s = -1.9515295891e-4f;
+    s = s * z + 8.3321608736e-3f;
+    s = s * z - 1.6666654611e-1f;
+    s = s * z * r + r;
+    float c = 2.443315711809948e-5f;
+    c = c * z - 1.388731625493765e-3f;
+    c = c * z + 4.166664568298827e-2f;
+    c = c * z * z - 0.5f * z + 1.0f;
+    int q = ((int)k + quadrant) & 3;
+    float y = (q & 1) ? c : s;
+    return (q & 2) ? -y : y;
+}
+
+inline float sinApprox(float x) {
+    return sinQuadrantApprox(x, 0);
+}
+
+inline float cosApprox(float x) {
+    return sinQuadrantApprox(x, 1);
+}
+
+inline void expSpanScalar(const float* x, float* y, int n) {
+    for (int i = 0; i < n; ++i) {
+        y[i] = expApprox(x[i]);
+    }
+}
+
+inline void tanhSpanScalar(const float* x, float* y, int n) {
+    for (int i = 0; i < n; ++i) {
+        y[i] = tanhApprox(x[i]);
+    }
+}
+
+inline void sinSpanScalar(const float* x, float* y, int n) {
+    for (int i = 0; i < n; ++i) {
+        y[i] = sinApprox(x[i]);
+    }
+}
+
+inline void cosSpanScalar(const float* x, float* y, int n) {
+    for (int i = 0; i < n; ++i) {
+        y[i] = cosApprox(x[i]);
+    }
+}
+
+// y = x * scale - floor(x * scale), the position inside a period
+inline void fracSpanScalar(const float* x, float scale, float* y, int n) {
+    for (int i = 0; i < n; ++i) {
+        float s = x[i] * scale;
+        y[i] = s - std::floor(s);
+    }
+}
+
+inline float absMaxScalar(const float* x, int n) {
+    float m = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        m = std::max(m, std::fabs(x[i]));
+    }
+    return m;
+}
+
+// q = round(x * scale) clamped to [-127, 127], ties to even
+inline void quantizeI8Scalar(const float* x, float scale, int8_t* q, int n) {
+    for (int i = 0; i < n; ++i) {
+        q[i] = (int8_t)std::nearbyint(std::max(-127.0f, std::min(127.0f, x[i] * scale)));
+    }
+}
+
+// y[n] = W[n,:] . x for int8 rows, exact in 32 bits. The vector versions
+// need every value in [-127, 127].
+inline void matvecI8Scalar(int N, int K, const int8_t* W, int ldw, const int8_t* x, int32_t* y) {
+    for (int n = 0; n < N; ++n) {
+        const int8_t* w = W + (size_t)n * ldw;
+        int32_t s = 0;
+        for (int i = 0; i < K; ++i) {
+            s += (int32_t)w[i] * x[i];
+        }
+        y[n] = s;
+    }
+}
+
+
+/* *************************************************************** */
+/* Pruned layers in CSR form: the entries of row n are rowStart[n] to
+   rowStart[n + 1] of column and values, with the columns sorted */
+inline void spmvScalar(int N, const int* rowStart, const int* column, const float* values, const float* x, float* y) {
+    for (int n = 0; n < N; ++n) {
+        float s = 0.0f;
+        for (int j = rowStart[n]; j < rowStart[n + 1]; ++j) {
+            s += values[j] * x[column[j]];
+        }
+        y[n] = s;
+    }
+}
+
+// The sparse backpropRow for count entries of one row: dx[column] += g * w,
+// then w += step * x[column]. The columns of a row never repeat.
+inline void backpropRowSparseScalar(float g, float step, const int* column, const float* x, float* w, float* dx, int count) {
+    for (int j = 0; j < count; ++j) {
+        float wj = w[j];
+        dx[column[j]] += g * wj;
+        w[j] = wj + step * x[column[j]];
+    }
+}
+
+
+/* *************************************************************** */
+/* 16 bit weight storage. bfloat16 is the upper half of a float, IEEE
+   half has 5 exponent and 10 mantissa bits. Both round to nearest even,
+   bfloat16 flushes denormals to zero the way vcvtneps2bf16 does. The
+   matrix products widen the weights and accumulate in float. */
+
+// How an inference engine or a frozen layer keeps W
+enum WeightStorage {
+    Float32,
+    BFloat16,       // same range as float, 8 significant bits
+    Float16         // 11 significant bits, |w| below 65504
+};
+
+inline uint16_t floatToBf16(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    if ((x & 0x7FFFFFFF) > 0x7F800000) {
+        return (uint16_t)((x >> 16) | 0x40);
+    }
+    if ((x & 0x7F800000) == 0) {
+        return (uint16_t)((x >> 16) & 0x8000);
+    }
+    return (uint16_t)((x + 0x7FFF + ((x >> 16) & 1)) >> 16);
+}
+
+inline float bf16ToFloat(uint16_t h) {
+    uint32_t x = (uint32_t)h << 16;
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+inline uint16_t floatToHalf(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t a = x & 0x7FFFFFFF;
+    if (a > 0x7F800000) {
+        return (uint16_t)(sign | 0x7E00 | ((a >> 13) & 0x3FF));
+    }
+    if (a >= 0x47800000) {
+        return (uint16_t)(sign | 0x7C00);
+    }
+    if (a < 0x38800000) {
+        // half denormal, the value in units of 2^-24
+        int e = (int)(a >> 23);
+        if (e < 102) {
+            return (uint16_t)sign;
+        }
+        uint32_t m = (a & 0x7FFFFF) | 0x800000;
+        int shift = 126 - e;
+        uint32_t h = m >> shift;
+        uint32_t rest = m & ((1u << shift) - 1);
+        uint32_t half = 1u << (shift - 1);
+        if (rest > half || (rest == half && (h & 1))) {
+            h++;
+        }
+        return (uint16_t)(sign | h);
+    }
+    uint32_t h = ((a >> 23) - 112) << 10 | ((a >> 13) & 0x3FF);
+    uint32_t rest = a & 0x1FFF;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1))) {
+        h++;
+    }
+    return (uint16_t)(sign | h);
+}
+
+inline float halfToFloat(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t e = (h >> 10) & 0x1F;
+    uint32_t m = h & 0x3FF;
+    uint32_t x;
+    if (e == 0x1F) {
+        x = sign | 0x7F800000 | (m << 13) | (m != 0 ? 0x400000 : 0);
+    } else if (e != 0) {
+        x = sign | ((e + 112) << 23) | (m << 13);
+    } else if (m == 0) {
+        x = sign;
+    } else {
+        int s = 0;
+        while ((m & 0x400) == 0) {
+            m <<= 1;
+            s++;
+        }
+        x = sign | ((uint32_t)(113 - s) << 23) | ((m & 0x3FF) << 13);
+    }
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+inline void toBf16Scalar(const float* x, uint16_t* y, int n) {
+    for (int i = 0; i < n; ++i) {
+        y[i] = floatToBf16(x[i]);
+    }
+}
+
+inline void toHalfScalar(const float* x, uint16_t* y, int n) {
+    for (int i = 0; i < n; ++i) {
+        y[i] = floatToHalf(x[i]);
+    }
+}
+
+inline void matvecBf16Scalar(int N, int K, const uint16_t* W, int ldw, const float* x, float* y) {
+    for (int n = 0; n < N; ++n) {
+        const uint16_t* w = W + (size_t)n * ldw;
+        float s = 0.0f;
+        for (int i = 0; i < K; ++i) {
+            s += bf16ToFloat(w[i]) * x[i];
+        }
+        y[n] = s;
+    }
+}
+
+inline void matvecHalfScalar(int N, int K, const uint16_t* W, int ldw, const float* x, float* y) {
+    for (int n = 0; n < N; ++n) {
+        const uint16_t* w = W + (size_t)n * ldw;
+        float s = 0.0f;
+        for (int i = 0; i < K; ++i) {
+            s += halfToFloat(w[i]) * x[i];
+        }
+        y[n] = s;
+    }
+}
+
+// y += a * x for a row of 16 bit weights
+inline void axpyBf16Scalar(float a, const uint16_t* x, float* y, int n) {
+    for (int i = 0; i < n; ++i) {
+        y[i] += a * bf16ToFloat(x[i]);
+    }
+}
+
+inline void axpyHalfScalar(float a, const uint16_t* x, float* y, int n) {
+    for (int i = 0; i < n; ++i) {
+        y[i] += a * halfToFloat(x[i]);
+    }
+}
+
+
+#ifdef ANN_X86
+/* *************************************************************** */
+/* AVX2 + FMA */
+__attribute__((target("avx2,fma")))
+inline float hsum256(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+__attribute__((target("avx2,fma")))
+inline float dotAvx2(const float* a, const float* b, int n) {
+    __m256 s0 = _mm256_setzero_ps();
+    __m256 s1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+        s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), s1);
+    }
+    if (i + 8 <= n) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+        i += 8;
+    }
+    float s = hsum256(_mm256_add_ps(s0, s1));
+    for (; i < n; ++i) {
+        s += a[i] * b[i];
+    }
+    return s;
+}
+
+// Four rows per pass, so every load of x feeds four FMAs
+__attribute__((target("avx2,fma")))
+inline void matvecAvx2(int N, int K, const float* W, int ldw, const float* x, float* y) {
+    int n = 0;
+    for (; n + 4 <= N; n += 4) {
+        const float* w0 = W + (size_t)n * ldw;
+        const float* w1 = w0 + ldw;
+        const float* w2 = w1 + ldw;
+        const float* w3 = w2 + ldw;
+        __m256 s0 = _mm256_setzero_ps();
+        __m256 s1 = _mm256_setzero_ps();
+        __m256 s2 = _mm256_setzero_ps();
+        __m256 s3 = _mm256_setzero_ps();
+        int i = 0;
+        for (; i + 8 <= K; i += 8) {
+            __m256 vx = _mm256_loadu_ps(x + i);
+            s0 = _mm256_fmadd_ps(_mm256_loadu_ps(w0 + i), vx, s0);
+            s1 = _mm256_fmadd_ps(_mm256_loadu_ps(w1 + i), vx, s1);
+            s2 = _mm256_fmadd_ps(_mm256_loadu_ps(w2 + i), vx, s2);
+            s3 = _mm256_fmadd_ps(_mm256_loadu_ps(w3 + i), vx, s3);
+        }
+        float r0 = hsum256(s0), r1 = hsum256(s1), r2 = hsum256(s2), r3 = hsum256(s3);
+        for (; i < K; ++i) {
+            r0 += w0[i] * x[i];
+            r1 += w1[i] * x[i];
+            r2 += w2[i] * x[i];
+            r3 += w3[i] * x[i];
+        }
+        y[n] = r0;
+        y[n + 1] = r1;
+        y[n + 2] = r2;
+        y[n + 3] = r3;
+    }
+    for (; n < N; ++n) {
+        y[n] = dotAvx2(W + (size_t)n * ldw, x, K);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline void axpyAvx2(float a, const float* x, float* y, int n) {
+    __m256 va = _mm256_set1_ps(a);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+    for (; i < n; ++i) {
+        y[i] += a * x[i];
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline void backpropRowAvx2(float g, float step, const float* x, float* w, float* dx, int n) {
+    __m256 vg = _mm256_set1_ps(g);
+    __m256 vs = _mm256_set1_ps(step);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 vw = _mm256_loadu_ps(w + i);
+        _mm256_storeu_ps(dx + i, _mm256_fmadd_ps(vg, vw, _mm256_loadu_ps(dx + i)));
+        _mm256_storeu_ps(w + i, _mm256_fmadd_ps(vs, _mm256_loadu_ps(x + i), vw));
+    }
+    for (; i < n; ++i) {
+        float wi = w[i];
+        dx[i] += g * wi;
+        w[i] = wi + step * x[i];
+    }
+}
+
+// 4 x 3 register tile of dot products, vectorized along K
+__attribute__((target("avx2,fma")))
+inline void gemmNTTileAvx2(int K, const float* A, int lda, const float* B, int ldb, float* C, int ldc) {
+    __m256 acc[4][3];
+    for (int r = 0; r < 4; ++r) {
+        for (int c = 0; c < 3; ++c) {
+            acc[r][c] = _mm256_setzero_ps();
+        }
+    }
+    int k = 0;
+    for (; k + 8 <= K; k += 8) {
+        __m256 b0 = _mm256_loadu_ps(B + k);
+        __m256 b1 = _mm256_loadu_ps(B + (size_t)ldb + k);
+        __m256 b2 = _mm256_loadu_ps(B + (size_t)2 * ldb + k);
+        for (int r = 0; r < 4; ++r) {
+            __m256 a = _mm256_loadu_ps(A + (size_t)r * lda + k);
+            acc[r][0] = _mm256_fmadd_ps(a, b0, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_ps(a, b1, acc[r][1]);
+            acc[r][2] = _mm256_fmadd_ps(a, b2, acc[r][2]);
+        }
+    }
+    for (int r = 0; r < 4; ++r) {
+        for (int c = 0; c < 3; ++c) {
+            float sum = hsum256(acc[r][c]);
+            for (int i = k; i < K; ++i) {
+                sum += A[(size_t)r * lda + i] * B[(size_t)c * ldb + i];
+            }
+            C[(size_t)r * ldc + c] = sum;
+        }
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline void gemmNTAvx2(int M, int N, int K, const float* A, int lda, const float* B, int ldb, float* C, int ldc) {
+    // Blocks of B rows small enough to stay in L2 while the batch streams over them
+    const int blockN = 48;
+    for (int n0 = 0; n0 < N; n0 += blockN) {
+        int n1 = (n0 + blockN < N) ? n0 + blockN : N;
+        int m = 0;
+        for (; m + 4 <= M; m += 4) {
+            int n = n0;
+            for (; n + 3 <= n1; n += 3) {
+                gemmNTTileAvx2(K, A + (size_t)m * lda, lda, B + (size_t)n * ldb, ldb, C + (size_t)m * ldc + n, ldc);
+            }
+            for (; n < n1; ++n) {
+                for (int r = 0; r < 4; ++r) {
+                    C[(size_t)(m + r) * ldc + n] = dotAvx2(A + (size_t)(m + r) * lda, B + (size_t)n * ldb, K);
+                }
+            }
+        }
+        for (; m < M; ++m) {
+            for (int n = n0; n < n1; ++n) {
+                C[(size_t)m * ldc + n] = dotAvx2(A + (size_t)m * lda, B + (size_t)n * ldb, K);
+            }
+        }
+    }
+}
+
+// ROWS x 16 register tile of C = A * B over N, added to C when accumulate is set
+template <int ROWS>
+__attribute__((target("avx2,fma")))
+inline void gemmNNTileAvx2(int N, const float* A, int lda, const float* B, int ldb, float* C, int ldc, bool accumulate) {
+    __m256 acc[ROWS][2];
+    for (int r = 0; r < ROWS; ++r) {
+        acc[r][0] = accumulate ? _mm256_loadu_ps(C + (size_t)r * ldc) : _mm256_setzero_ps();
+        acc[r][1] = accumulate ? _mm256_loadu_ps(C + (size_t)r * ldc + 8) : _mm256_setzero_ps();
+    }
+    for (int n = 0; n < N; ++n) {
+        __m256 b0 = _mm256_loadu_ps(B + (size_t)n * ldb);
+        __m256 b1 = _mm256_loadu_ps(B + (size_t)n * ldb + 8);
+        for (int r = 0; r < ROWS; ++r) {
+            __m256 a = _mm256_broadcast_ss(A + (size_t)r * lda + n);
+            acc[r][0] = _mm256_fmadd_ps(a, b0, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_ps(a, b1, acc[r][1]);
+        }
+    }
+    for (int r = 0; r < ROWS; ++r) {
+        _mm256_storeu_ps(C + (size_t)r * ldc, acc[r][0]);
+        _mm256_storeu_ps(C + (size_t)r * ldc + 8, acc[r][1]);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline void gemmNNAvx2(int M, int N, int K, const float* A, int lda, const float* B, int ldb, float* C, int ldc) {
+    // Panels of B (blockN x 16) stay in L1 while every row block of A uses them
+    const int blockN = 256;
+    int kv = K & ~15;
+    for (int n0 = 0; n0 < N; n0 += blockN) {
+        int nb = (n0 + blockN < N) ? blockN : N - n0;
+        const float* Ab = A + n0;
+        const float* Bb = B + (size_t)n0 * ldb;
+        for (int k = 0; k < kv; k += 16) {
+            int m = 0;
+            for (; m + 4 <= M; m += 4) {
+                gemmNNTileAvx2<4>(nb, Ab + (size_t)m * lda, lda, Bb + k, ldb, C + (size_t)m * ldc + k, ldc, n0 > 0);
+            }
+            for (; m < M; ++m) {
+                gemmNNTileAvx2<1>(nb, Ab + (size_t)m * lda, lda, Bb + k, ldb, C + (size_t)m * ldc + k, ldc, n0 > 0);
+            }
+        }
+    }
+    for (int m = 0; m < M; ++m) {
+        for (int i = kv; i < K; ++i) {
+            float sum = 0.0f;
+            for (int n = 0; n < N; ++n) {
+                sum += A[(size_t)m * lda + n] * B[(size_t)n * ldb + i];
+            }
+            C[(size_t)m * ldc + i] = sum;
+        }
+    }
+}
+
+// ROWS x 16 tile of C, loaded once, accumulated over the whole batch, stored once
+template <int ROWS>
+__attribute__((target("avx2,fma")))
+inline void gemmTNTileAvx2(int M, const float* A, int lda, const float* B, int ldb, float* C, int ldc) {
+    __m256 acc[ROWS][2];
+    for (int r = 0; r < ROWS; ++r) {
+        acc[r][0] = _mm256_loadu_ps(C + (size_t)r * ldc);
+        acc[r][1] = _mm256_loadu_ps(C + (size_t)r * ldc + 8);
+    }
+    for (int m = 0; m < M; ++m) {
+        __m256 b0 = _mm256_loadu_ps(B + (size_t)m * ldb);
+        __m256 b1 = _mm256_loadu_ps(B + (size_t)m * ldb + 8);
+        for (int r = 0; r < ROWS; ++r) {
+            __m256 a = _mm256_broadcast_ss(A + (size_t)m * lda + r);
+            acc[r][0] = _mm256_fmadd_ps(a, b0, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_ps(a, b1, acc[r][1]);
+        }
+    }
+    for (int r = 0; r < ROWS; ++r) {
+        _mm256_storeu_ps(C + (size_t)r * ldc, acc[r][0]);
+        _mm256_storeu_ps(C + (size_t)r * ldc + 8, acc[r][1]);
+    }
+}
+
+template <int ROWS>
+__attribute__((target("avx2,fma")))
+inline void gemmTNRowsAvx2(int M, int K, const float* A, int lda, const float* B, int ldb, float* C, int ldc) {
+    int k = 0;
+    for (; k + 16 <= K; k += 16) {
+        gemmTNTileAvx2<ROWS>(M, A, lda, B + k, ldb, C + k, ldc);
+    }
+    for (int r = 0; r < ROWS; ++r) {
+        for (int i = k; i < K; ++i) {
+            float sum = C[(size_t)r * ldc + i];
+            for (int m = 0; m < M; ++m) {
+                sum += A[(size_t)m * lda + r] * B[(size_t)m * ldb + i];
+            }
+            C[(size_t)r * ldc + i] = sum;
+        }
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline void gemmTNAvx2(int M, int N, int K, const float* A, int lda, const float* B, int ldb, float* C, int ldc) {
+    int n = 0;
+    for (; n + 4 <= N; n += 4) {
+        gemmTNRowsAvx2<4>(M, K, A + n, lda, B, ldb, C + (size_t)n * ldc, ldc);
+    }
+    for (; n < N; ++n) {
+        gemmTNRowsAvx2<1>(M, K, A + n, lda, B, ldb, C + (size_t)n * ldc, ldc);
+    }
+}
+
+/* *************************************************************** */
+/* AVX2 versions of the approximations, same polynomials 8 lanes at a time */
+__attribute__((target("avx2,fma")))
+inline __m256 exp256(__m256 x) {
+    x = _mm256_max_ps(_mm256_min_ps(x, _mm256_set1_ps(88.0f)), _mm256_set1_ps(-87.0f));
+    __m256 k = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(k, _mm256_set1_ps(0.693359375f), x);
+    r = _mm256_fnmadd_ps(k, _mm256_set1_ps(-2.12194440e-4f), r);
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+    __m256 y = _mm256_add_ps(_mm256_fmadd_ps(p, _mm256_mul_ps(r, r), r), _mm256_set1_ps(1.0f));
+    __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(k), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(bits));
+}
+
+__attribute__((target("avx2,fma")))
+inline __m256 tanh256(__m256 x) {
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 a = _mm256_andnot_ps(sign, x);
+    __m256 z = _mm256_mul_ps(x, x);
+    __m256 p = _mm256_set1_ps(-5.70498872745e-3f);
+    p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(2.06390887954e-2f));
+    p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(-5.37397155531e-2f));
+    p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(1.33314422036e-1f));
+    p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(-3.33332819422e-1f));
+    __m256 small = _mm256_fmadd_ps(_mm256_mul_ps(p, z), x, x);
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 t = exp256(_mm256_mul_ps(a, _mm256_set1_ps(-2.0f)));
+    __m256 large = _mm256_div_ps(_mm256_sub_ps(one, t), _mm256_add_ps(one, t));
+    large = _mm256_or_ps(large, _mm256_and_ps(sign, x));
+    return _mm256_blendv_ps(large, small, _mm256_cmp_ps(a, _mm256_set1_ps(0.625f), _CMP_LT_OQ));
+}
+
+__attribute__((target("avx2,fma")))
+inline __m256 sinQuadrant256(__m256 x, int quadrant) {
+    __m256 k = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(0.636619772367581343f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(k, _mm256_set1_ps(1.5703125f), x);
+    r = _mm256_fnmadd_ps(k, _mm256_set1_ps(4.837512969970703125e-4f), r);
+    r = _mm256_fnmadd_ps(k, _mm256_set1_ps(7.54978995489188216e-8f), r);
+    __m256 z = _mm256_mul_ps(r, r);
+    __m256 s = _mm256_set1_ps(-1.9515295891e-4f);
+    s = _mm256_fmadd_ps(s, z, _mm256_set1_ps(8.3321608736e-3f));
+    s = _mm256_fmadd_ps(s, z, _mm256_set1_ps(-1.6666654611e-1f));
+    s = _mm256_fmadd_ps(_mm256_mul_ps(s, z), r, r);
+    __m256 c = _mm256_set1_ps(2.443315711809948e-5f);
+    c = _mm256_fmadd_ps(c, z, _mm256_set1_ps(-1.388731625493765e-3f));
+    c = _mm256_fmadd_ps(c, z, _mm256_set1_ps(4.166664568298827e-2f));
+    c = _mm256_fmadd_ps(_mm256_mul_ps(c, z), z, _mm256_fnmadd_ps(_mm256_set1_ps(0.5f), z, _mm256_set1_ps(1.0f)));
+    __m256i q = _mm256_add_epi32(_mm256_cvtps_epi32(k), _mm256_set1_epi32(quadrant));
+    __m256i odd = _mm256_cmpeq_epi32(_mm256_and_si256(q, _mm256_set1_epi32(1)), _mm256_set1_epi32(1));
+    __m256 y = _mm256_blendv_ps(s, c, _mm256_castsi256_ps(odd));
+    __m256i negate = _mm256_slli_epi32(_mm256_and_si256(q, _mm256_set1_epi32(2)), 30);
+    return _mm256_xor_ps(y, _mm256_castsi256_ps(negate));
+}
+
+__attribute__((target("avx2,fma")))
+inline void expSpanAvx2(const float* x, float* y, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(y + i, exp256(_mm256_loadu_ps(x + i)));
+    }
+    for (; i < n; ++i) {
+        y[i] = expApprox(x[i]);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline void tanhSpanAvx2(const float* x, float* y, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(y + i, tanh256(_mm256_loadu_ps(x + i)));
+    }
+    for (; i < n; ++i) {
+        y[i] = tanhApprox(x[i]);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline void sinSpanAvx2(const float* x, float* y, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(y + i, sinQuadrant256(_mm256_loadu_ps(x + i), 0));
+    }
+    for (; i < n; ++i) {
+        y[i] = sinApprox(x[i]);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline void cosSpanAvx2(const float* x, float* y, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(y + i, sinQuadrant256(_mm256_loadu_ps(x + i), 1));
+    }
+    for (; i < n; ++i) {
+        y[i] = cosApprox(x[i]);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline void fracSpanAvx2(const float* x, float scale, float* y, int n) {
+    __m256 vs = _mm256_set1_ps(scale);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 s = _mm256_mul_ps(_mm256_loadu_ps(x + i), vs);
+        _mm256_storeu_ps(y + i, _mm256_sub_ps(s, _mm256_floor_ps(s)));
+    }
+    for (; i < n; ++i) {
+        float s = x[i] * scale;
+        y[i] = s - std::floor(s);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline float absMaxAvx2(const float* x, int n) {
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 m = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        m = _mm256_max_ps(m, _mm256_andnot_ps(sign, _mm256_loadu_ps(x + i)));
+    }
+    __m128 h = _mm_max_ps(_mm256_castps256_ps128(m), _mm256_extractf128_ps(m, 1));
+    h = _mm_max_ps(h, _mm_movehl_ps(h, h));
+    h = _mm_max_ss(h, _mm_movehdup_ps(h));
+    float r = _mm_cvtss_f32(h);
+    for (; i < n; ++i) {
+        r = std::max(r, std::fabs(x[i]));
+    }
+    return r;
+}
+
+__attribute__((target("avx2,fma")))
+inline __m256i quantizeI8Step(const float* x, __m256 vs) {
+    __m256 r = _mm256_mul_ps(_mm256_loadu_ps(x), vs);
+    r = _mm256_min_ps(_mm256_max_ps(r, _mm256_set1_ps(-127.0f)), _mm256_set1_ps(127.0f));
+    return _mm256_cvtps_epi32(r);
+}
+
+// The packs work inside 128 bit lanes, the final permute restores the order
+__attribute__((target("avx2,fma")))
+inline void quantizeI8Avx2(const float* x, float scale, int8_t* q, int n) {
+    __m256 vs = _mm256_set1_ps(scale);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i ab = _mm256_packs_epi32(quantizeI8Step(x + i, vs), quantizeI8Step(x + i + 8, vs));
+        __m256i cd = _mm256_packs_epi32(quantizeI8Step(x + i + 16, vs), quantizeI8Step(x + i + 24, vs));
+        __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_packs_epi16(ab, cd), order);
+        _mm256_storeu_si256((__m256i*)(q + i), bytes);
+    }
+    quantizeI8Scalar(x + i, scale, q + i, n - i);
+}
+
+// maddubs multiplies unsigned by signed bytes, so x is made positive and
+// its sign is moved onto w. With both in [-127, 127] the pair sums fit in
+// 16 bits and nothing saturates.
+__attribute__((target("avx2,fma")))
+inline __m256i dotI8Step(__m256i s, __m256i ax, __m256i vx, const int8_t* w) {
+    __m256i p = _mm256_maddubs_epi16(ax, _mm256_sign_epi8(_mm256_loadu_si256((const __m256i*)w), vx));
+    return _mm256_add_epi32(s, _mm256_madd_epi16(p, _mm256_set1_epi16(1)));
+}
+
+__attribute__((target("avx2,fma")))
+inline int32_t hsumI32Avx2(__m256i v) {
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4E));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xB1));
+    return _mm_cvtsi128_si32(s);
+}
+
+__attribute__((target("avx2,fma")))
+inline void matvecI8Avx2(int N, int K, const int8_t* W, int ldw, const int8_t* x, int32_t* y) {
+    int n = 0;
+    for (; n + 4 <= N; n += 4) {
+        const int8_t* w0 = W + (size_t)n * ldw;
+        const int8_t* w1 = w0 + ldw;
+        const int8_t* w2 = w1 + ldw;
+        const int8_t* w3 = w2 + ldw;
+        __m256i s0 = _mm256_setzero_si256();
+        __m256i s1 = _mm256_setzero_si256();
+        __m256i s2 = _mm256_setzero_si256();
+        __m256i s3 = _mm256_setzero_si256();
+        int i = 0;
+        for (; i + 32 <= K; i += 32) {
+            __m256i vx = _mm256_loadu_si256((const __m256i*)(x + i));
+            __m256i ax = _mm256_abs_epi8(vx);
+            s0 = dotI8Step(s0, ax, vx, w0 + i);
+            s1 = dotI8Step(s1, ax, vx, w1 + i);
+            s2 = dotI8Step(s2, ax, vx, w2 + i);
+            s3 = dotI8Step(s3, ax, vx, w3 + i);
+        }
+        int32_t r0 = hsumI32Avx2(s0), r1 = hsumI32Avx2(s1), r2 = hsumI32Avx2(s2), r3 = hsumI32Avx2(s3);
+        for (; i < K; ++i) {
+            r0 += (int32_t)w0[i] * x[i];
+            r1 += (int32_t)w1[i] * x[i];
+            r2 += (int32_t)w2[i] * x[i];
+            r3 += (int32_t)w3[i] * x[i];
+        }
+        y[n] = r0;
+        y[n + 1] = r1;
+        y[n + 2] = r2;
+        y[n + 3] = r3;
+    }
+    for (; n < N; ++n) {
+        const int8_t* w = W + (size_t)n * ldw;
+        __m256i s = _mm256_setzero_si256();
+        int i = 0;
+        for (; i + 32 <= K; i += 32) {
+            __m256i vx = _mm256_loadu_si256((const __m256i*)(x + i));
+            s = dotI8Step(s, _mm256_abs_epi8(vx), vx, w + i);
+        }
+        int32_t r = hsumI32Avx2(s);
+        for (; i < K; ++i) {
+            r += (int32_t)w[i] * x[i];
+        }
+        y[n] = r;
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline void spmvAvx2(int N, const int* rowStart, const int* column, const float* values, const float* x, float* y) {
+    for (int n = 0; n < N; ++n) {
+        __m256 s = _mm256_setzero_ps();
+        int j = rowStart[n];
+        int end = rowStart[n + 1];
+        for (; j + 8 <= end; j += 8) {
+            __m256 vx = _mm256_i32gather_ps(x, _mm256_loadu_si256((const __m256i*)(column + j)), 4);
+            s = _mm256_fmadd_ps(_mm256_loadu_ps(values + j), vx, s);
+        }
+        float r = hsum256(s);
+        for (; j < end; ++j) {
+            r += values[j] * x[column[j]];
+        }
+        y[n] = r;
+    }
+}
+
+// Eight 16 bit weights widened to float, vcvtph2ps for half and a shift
+// for bfloat16
+template <bool Half>
+__attribute__((target("avx2,fma,f16c")))
+inline __m256 load16Avx2(const uint16_t* w) {
+    __m128i v = _mm_loadu_si128((const __m128i*)w);
+    if (Half) {
+        return _mm256_cvtph_ps(v);
+    }
+    return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(v), 16));
+}
+
+template <bool Half>
+__attribute__((target("avx2,fma,f16c")))
+inline void matvec16Avx2(int N, int K, const uint16_t* W, int ldw, const float* x, float* y) {
+    int n = 0;
+    for (; n + 4 <= N; n += 4) {
+        const uint16_t* w0 = W + (size_t)n * ldw;
+        const uint16_t* w1 = w0 + ldw;
+        const uint16_t* w2 = w1 + ldw;
+        const uint16_t* w3 = w2 + ldw;
+        __m256 s0 = _mm256_setzero_ps();
+        __m256 s1 = _mm256_setzero_ps();
+        __m256 s2 = _mm256_setzero_ps();
+        __m256 s3 = _mm256_setzero_ps();
+        int i = 0;
+        for (; i + 8 <= K; i += 8) {
+            __m256 vx = _mm256_loadu_ps(x + i);
+            s0 = _mm256_fmadd_ps(load16Avx2<Half>(w0 + i), vx, s0);
+            s1 = _mm256_fmadd_ps(load16Avx2<Half>(w1 + i), vx, s1);
+            s2 = _mm256_fmadd_ps(load16Avx2<Half>(w2 + i), vx, s2);
+            s3 = _mm256_fmadd_ps(load16Avx2<Half>(w3 + i), vx, s3);
+        }
+        float r0 = hsum256(s0), r1 = hsum256(s1), r2 = hsum256(s2), r3 = hsum256(s3);
+        for (; i < K; ++i) {
+            r0 += (Half ? halfToFloat(w0[i]) : bf16ToFloat(w0[i])) * x[i];
+            r1 += (Half ? halfToFloat(w1[i]) : bf16ToFloat(w1[i])) * x[i];
+            r2 += (Half ? halfToFloat(w2[i]) : bf16ToFloat(w2[i])) * x[i];
+            r3 += (Half ? halfToFloat(w3[i]) : bf16ToFloat(w3[i])) * x[i];
+        }
+        y[n] = r0;
+        y[n + 1] = r1;
+        y[n + 2] = r2;
+        y[n + 3] = r3;
+    }
+    for (; n < N; ++n) {
+        const uint16_t* w = W + (size_t)n * ldw;
+        __m256 s = _mm256_setzero_ps();
+        int i = 0;
+        for (; i + 8 <= K; i += 8) {
+            s = _mm256_fmadd_ps(load16Avx2<Half>(w + i), _mm256_loadu_ps(x + i), s);
+        }
+        float r = hsum256(s);
+        for (; i < K; ++i) {
+            r += (Half ? halfToFloat(w[i]) : bf16ToFloat(w[i])) * x[i];
+        }
+        y[n] = r;
+    }
+}
+
+template <bool Half>
+__attribute__((target("avx2,fma,f16c")))
+inline void axpy16Avx2(float a, const uint16_t* x, float* y, int n) {
+    __m256 va = _mm256_set1_ps(a);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(va, load16Avx2<Half>(x + i), _mm256_loadu_ps(y + i)));
+    }
+    for (; i < n; ++i) {
+        y[i] += a * (Half ? halfToFloat(x[i]) : bf16ToFloat(x[i]));
+    }
+}
+
+__attribute__((target("avx2,fma,f16c")))
+inline void toHalfF16c(const float* x, uint16_t* y, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i*)(y + i), h);
+    }
+    toHalfScalar(x + i, y + i, n - i);
+}
+
+/* *************************************************************** */
+/* AVX-512, tails are handled with masked loads */
+__attribute__((target("avx512f")))
+inline float hsum512(__m512 v) {
+    alignas(64) float lane[16];
+    _mm512_store_ps(lane, v);
+    float s = 0.0f;
+    for (int i = 0; i < 16; ++i) {
+        s += lane[i];
+    }
+    return s;
+}
+
+__attribute__((target("avx512f")))
+inline float dotAvx512(const float* a, const float* b, int n) {
+    __m512 s0 = _mm512_setzero_ps();
+    __m512 s1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), s0);
+        s1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), s1);
+    }
+    for (; i < n; i += 16) {
+        __mmask16 m = (n - i >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+        s0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i), s0);
+    }
+    return hsum512(_mm512_add_ps(s0, s1));
+}
+
+__attribute__((target("avx512f")))
+inline void matvecAvx512(int N, int K, const float* W, int ldw, const float* x, float* y) {
+    int n = 0;
+    for (; n + 4 <= N; n += 4) {
+        const float* w0 = W + (size_t)n * ldw;
+        const float* w1 = w0 + ldw;
+        const float* w2 = w1 + ldw;
+        const float* w3 = w2 + ldw;
+        __m512 s0 = _mm512_setzero_ps();
+        __m512 s1 = _mm512_setzero_ps();
+        __m512 s2 = _mm512_setzero_ps();
+        __m512 s3 = _mm512_setzero_ps();
+        for (int i = 0; i < K; i += 16) {
+            __mmask16 m = (K - i >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (K - i)) - 1);
+            __m512 vx = _mm512_maskz_loadu_ps(m, x + i);
+            s0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, w0 + i), vx, s0);
+            s1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, w1 + i), vx, s1);
+            s2 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, w2 + i), vx, s2);
+            s3 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, w3 + i), vx, s3);
+        }
+        y[n] = hsum512(s0);
+        y[n + 1] = hsum512(s1);
+        y[n + 2] = hsum512(s2);
+        y[n + 3] = hsum512(s3);
+    }
+    for (; n < N; ++n) {
+        y[n] = dotAvx512(W + (size_t)n * ldw, x, K);
+    }
+}
+
+__attribute__((target("avx512f")))
+inline void axpyAvx512(float a, const float* x, float* y, int n) {
+    __m512 va = _mm512_set1_ps(a);
+    for (int i = 0; i < n; i += 16) {
+        __mmask16 m = (n - i >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+        __m512 vy = _mm512_fmadd_ps(va, _mm512_maskz_loadu_ps(m, x + i), _mm512_maskz_loadu_ps(m, y + i));
+        _mm512_mask_storeu_ps(y + i, m, vy);
+    }
+}
+
+__attribute__((target("avx512f")))
+inline void backpropRowAvx512(float g, float step, const float* x, float* w, float* dx, int n) {
+    __m512 vg = _mm512_set1_ps(g);
+    __m512 vs = _mm512_set1_ps(step);
+    for (int i = 0; i < n; i += 16) {
+        __mmask16 m = (n - i >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+        __m512 vw = _mm512_maskz_loadu_ps(m, w + i);
+        _mm512_mask_storeu_ps(dx + i, m, _mm512_fmadd_ps(vg, vw, _mm512_maskz_loadu_ps(m, dx + i)));
+        _mm512_mask_storeu_ps(w + i, m, _mm512_fmadd_ps(vs, _mm512_maskz_loadu_ps(m, x + i), vw));
+    }
+}
+
+// The masked forms of max, min and the conversion are used because GCC 12
+// warns about the undefined source operand inside the plain ones
+__attribute__((target("avx512f")))
+inline float absMaxAvx512(const float* x, int n) {
+    __m512 m = _mm512_setzero_ps();
+    for (int i = 0; i < n; i += 16) {
+        __mmask16 k = (n - i >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+        m = _mm512_mask_max_ps(m, k, m, _mm512_abs_ps(_mm512_maskz_loadu_ps(k, x + i)));
+    }
+    alignas(64) float lane[16];
+    _mm512_store_ps(lane, m);
+    float r = 0.0f;
+    for (int i = 0; i < 16; ++i) {
+        r = std::max(r, lane[i]);
+    }
+    return r;
+}
+
+__attribute__((target("avx512f")))
+inline void quantizeI8Avx512(const float* x, float scale, int8_t* q, int n) {
+    const __m512 vs = _mm512_set1_ps(scale);
+    const __m512 lo = _mm512_set1_ps(-127.0f);
+    const __m512 hi = _mm512_set1_ps(127.0f);
+    for (int i = 0; i < n; i += 16) {
+        __mmask16 k = (n - i >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+        __m512 r = _mm512_mul_ps(_mm512_maskz_loadu_ps(k, x + i), vs);
+        r = _mm512_mask_max_ps(r, k, r, lo);
+        r = _mm512_mask_min_ps(r, k, r, hi);
+        _mm512_mask_cvtepi32_storeu_epi8(q + i, k, _mm512_maskz_cvtps_epi32(k, r));
+    }
+}
+
+__attribute__((target("avx512f")))
+inline int32_t hsumI32Avx512(__m512i v) {
+    alignas(64) int32_t lane[16];
+    _mm512_store_si512(lane, v);
+    int32_t s = 0;
+    for (int i = 0; i < 16; ++i) {
+        s += lane[i];
+    }
+    return s;
+}
+
+// VNNI adds the four byte products straight into 32 bit lanes, the sign
+// of x is moved onto w as in the AVX2 version
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+inline __m512i dotI8Vnni(__m512i s, __m512i ax, __mmask64 neg, __mmask64 m, const int8_t* w) {
+    __m512i vw = _mm512_maskz_loadu_epi8(m, w);
+    return _mm512_dpbusd_epi32(s, ax, _mm512_mask_sub_epi8(vw, neg, _mm512_setzero_si512(), vw));
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+inline void matvecI8Vnni(int N, int K, const int8_t* W, int ldw, const int8_t* x, int32_t* y) {
+    int n = 0;
+    for (; n + 4 <= N; n += 4) {
+        const int8_t* w0 = W + (size_t)n * ldw;
+        const int8_t* w1 = w0 + ldw;
+        const int8_t* w2 = w1 + ldw;
+        const int8_t* w3 = w2 + ldw;
+        __m512i s0 = _mm512_setzero_si512();
+        __m512i s1 = _mm512_setzero_si512();
+        __m512i s2 = _mm512_setzero_si512();
+        __m512i s3 = _mm512_setzero_si512();
+        for (int i = 0; i < K; i += 64) {
+            __mmask64 m = (K - i >= 64) ? ~(__mmask64)0 : (((__mmask64)1 << (K - i)) - 1);
+            __m512i vx = _mm512_maskz_loadu_epi8(m, x + i);
+            __m512i ax = _mm512_abs_epi8(vx);
+            __mmask64 neg = _mm512_movepi8_mask(vx);
+            s0 = dotI8Vnni(s0, ax, neg, m, w0 + i);
+            s1 = dotI8Vnni(s1, ax, neg, m, w1 + i);
+            s2 = dotI8Vnni(s2, ax, neg, m, w2 + i);
+            s3 = dotI8Vnni(s3, ax, neg, m, w3 + i);
+        }
+        y[n] = hsumI32Avx512(s0);
+        y[n + 1] = hsumI32Avx512(s1);
+        y[n + 2] = hsumI32Avx512(s2);
+        y[n + 3] = hsumI32Avx512(s3);
+    }
+    for (; n < N; ++n) {
+        const int8_t* w = W + (size_t)n * ldw;
+        __m512i s = _mm512_setzero_si512();
+        for (int i = 0; i < K; i += 64) {
+            __mmask64 m = (K - i >= 64) ? ~(__mmask64)0 : (((__mmask64)1 << (K - i)) - 1);
+            __m512i vx = _mm512_maskz_loadu_epi8(m, x + i);
+            s = dotI8Vnni(s, _mm512_abs_epi8(vx), _mm512_movepi8_mask(vx), m, w + i);
+        }
+        y[n] = hsumI32Avx512(s);
+    }
+}
+
+__attribute__((target("avx512f")))
+inline void spmvAvx512(int N, const int* rowStart, const int* column, const float* values, const float* x, float* y) {
+    for (int n = 0; n < N; ++n) {
+        __m512 s = _mm512_setzero_ps();
+        int end = rowStart[n + 1];
+        for (int j = rowStart[n]; j < end; j += 16) {
+            __mmask16 m = (end - j >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (end - j)) - 1);
+            __m512i idx = _mm512_maskz_loadu_epi32(m, column + j);
+            __m512 vx = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), m, idx, x, 4);
+            s = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, values + j), vx, s);
+        }
+        y[n] = hsum512(s);
+    }
+}
+
+// Gathers dx and x, scatters dx back; safe because a row has no repeated column
+__attribute__((target("avx512f")))
+inline void backpropRowSparseAvx512(float g, float step, const int* column, const float* x, float* w, float* dx, int count) {
+    __m512 vg = _mm512_set1_ps(g);
+    __m512 vs = _mm512_set1_ps(step);
+    const __m512 zero = _mm512_setzero_ps();
+    for (int j = 0; j < count; j += 16) {
+        __mmask16 m = (count - j >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (count - j)) - 1);
+        __m512i idx = _mm512_maskz_loadu_epi32(m, column + j);
+        __m512 vw = _mm512_maskz_loadu_ps(m, w + j);
+        __m512 vdx = _mm512_mask_i32gather_ps(zero, m, idx, dx, 4);
+        _mm512_mask_i32scatter_ps(dx, m, idx, _mm512_fmadd_ps(vg, vw, vdx), 4);
+        __m512 vx = _mm512_mask_i32gather_ps(zero, m, idx, x, 4);
+        _mm512_mask_storeu_ps(w + j, m, _mm512_fmadd_ps(vs, vx, vw));
+    }
+}
+
+// Sixteen 16 bit weights widened to float. A tail of count < 16 is
+// copied into a zeroed buffer first, so nothing past the row is read.
+template <bool Half>
+__attribute__((target("avx512f")))
+inline __m512 load16Avx512(const uint16_t* w, int count) {
+    __m256i v;
+    if (count >= 16) {
+        v = _mm256_loadu_si256((const __m256i*)w);
+    } else {
+        alignas(32) uint16_t tail[16] = {0};
+        std::memcpy(tail, w, count * sizeof(uint16_t));
+        v = _mm256_load_si256((const __m256i*)tail);
+    }
+    // masked forms for GCC 12, as in absMaxAvx512
+    if (Half) {
+        return _mm512_maskz_cvtph_ps((__mmask16)0xFFFF, v);
+    }
+    __m512i wide = _mm512_maskz_cvtepu16_epi32((__mmask16)0xFFFF, v);
+    return _mm512_castsi512_ps(_mm512_maskz_slli_epi32((__mmask16)0xFFFF, wide, 16));
+}
+
+template <bool Half>
+__attribute__((target("avx512f")))
+inline void matvec16Avx512(int N, int K, const uint16_t* W, int ldw, const float* x, float* y) {
+    int n = 0;
+    for (; n + 4 <= N; n += 4) {
+        const uint16_t* w0 = W + (size_t)n * ldw;
+        const uint16_t* w1 = w0 + ldw;
+        const uint16_t* w2 = w1 + ldw;
+        const uint16_t* w3 = w2 + ldw;
+        __m512 s0 = _mm512_setzero_ps();
+        __m512 s1 = _mm512_setzero_ps();
+        __m512 s2 = _mm512_setzero_ps();
+        __m512 s3 = _mm512_setzero_ps();
+        for (int i = 0; i < K; i += 16) {
+            __mmask16 m = (K - i >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (K - i)) - 1);
+            __m512 vx = _mm512_maskz_loadu_ps(m, x + i);
+            s0 = _mm512_fmadd_ps(load16Avx512<Half>(w0 + i, K - i), vx, s0);
+            s1 = _mm512_fmadd_ps(load16Avx512<Half>(w1 + i, K - i), vx, s1);
+            s2 = _mm512_fmadd_ps(load16Avx512<Half>(w2 + i, K - i), vx, s2);
+            s3 = _mm512_fmadd_ps(load16Avx512<Half>(w3 + i, K - i), vx, s3);
+        }
+        y[n] = hsum512(s0);
+        y[n + 1] = hsum512(s1);
+        y[n + 2] = hsum512(s2);
+        y[n + 3] = hsum512(s3);
+    }
+    for (; n < N; ++n) {
+        const uint16_t* w = W + (size_t)n * ldw;
+        __m512 s = _mm512_setzero_ps();
+        for (int i = 0; i < K; i += 16) {
+            __mmask16 m = (K - i >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (K - i)) - 1);
+            s = _mm512_fmadd_ps(load16Avx512<Half>(w + i, K - i), _mm512_maskz_loadu_ps(m, x + i), s);
+        }
+        y[n] = hsum512(s);
+    }
+}
+
+template <bool Half>
+__attribute__((target("avx512f")))
+inline void axpy16Avx512(float a, const uint16_t* x, float* y, int n) {
+    __m512 va = _mm512_set1_ps(a);
+    for (int i = 0; i < n; i += 16) {
+        __mmask16 m = (n - i >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+        __m512 vy = _mm512_maskz_loadu_ps(m, y + i);
+        _mm512_mask_storeu_ps(y + i, m, _mm512_fmadd_ps(va, load16Avx512<Half>(x + i, n - i), vy));
+    }
+}
+
+__attribute__((target("avx512f,avx512bf16")))
+inline void toBf16Avx512(const float* x, uint16_t* y, int n) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256bh h = _mm512_cvtneps_pbh(_mm512_loadu_ps(x + i));
+        _mm256_storeu_si256((__m256i*)(y + i), (__m256i)h);
+    }
+    toBf16Scalar(x + i, y + i, n - i);
+}
+#endif /* ANN_X86 */
+
+
+/* *************************************************************** */
+/* Runtime selection */
+struct Kernels {
+    enum Isa {
+        Scalar,
+        AVX2,
+        AVX512
+    };
+
+    Isa isa;
+    float (*dot)(const float* a, const float* b, int n);
+    void (*matvec)(int N, int K, const float* W, int ldw, const float* x, float* y);
+    void (*axpy)(float a, const float* x, float* y, int n);
+    void (*backpropRow)(float g, float step, const float* x, float* w, float* dx, int n);
+    void (*gemmNT)(int M, int N, int K, const float* A, int lda, const float* B, int ldb, float* C, int ldc);
+    void (*gemmNN)(int M, int N, int K, const float* A, int lda, const float* B, int ldb, float* C, int ldc);
+    void (*gemmTN)(int M, int N, int K, const float* A, int lda, const float* B, int ldb, float* C, int ldc);
+    void (*expSpan)(const float* x, float* y, int n);
+    void (*tanhSpan)(const float* x, float* y, int n);
+    void (*sinSpan)(const float* x, float* y, int n);
+    void (*cosSpan)(const float* x, float* y, int n);
+    void (*fracSpan)(const float* x, float scale, float* y, int n);
+    float (*absMax)(const float* x, int n);
+    void (*quantizeI8)(const float* x, float scale, int8_t* q, int n);
+    void (*spmv)(int N, const int* rowStart, const int* column, const float* values, const float* x, float* y);
+    void (*backpropRowSparse)(float g, float step, const int* column, const float* x, float* w, float* dx, int count);
+    void (*matvecI8)(int N, int K, const int8_t* W, int ldw, const int8_t* x, int32_t* y);
+    void (*toBf16)(const float* x, uint16_t* y, int n);
+    void (*toHalf)(const float* x, uint16_t* y, int n);
+    void (*matvecBf16)(int N, int K, const uint16_t* W, int ldw, const float* x, float* y);
+    void (*matvecHalf)(int N, int K, const uint16_t* W, int ldw, const float* x, float* y);
+    void (*axpyBf16)(float a, const uint16_t* x, float* y, int n);
+    void (*axpyHalf)(float a, const uint16_t* x, float* y, int n);
+
+    static Isa detect() {
+        Isa best = Scalar;
+#ifdef ANN_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            best = AVX2;
+        }
+        if (__builtin_cpu_supports("avx512f")) {
+            best = AVX512;
+        }
+#endif
+        const char* env = std::getenv("ANN_KERNEL");
+        if (env != nullptr) {
+            Isa wanted = Scalar;
+            if (std::strcmp(env, "avx2") == 0) {
+                wanted = AVX2;
+            } else if (std::strcmp(env, "avx512") == 0) {
+                wanted = AVX512;
+            }
+            if (wanted < best) {
+                best = wanted;
+            }
+        }
+        return best;
+    }
+
+    static Kernels select(Isa isa) {
+        Kernels k;
+        k.isa = isa;
+        k.dot = dotScalar;
+        k.matvec = matvecScalar;
+        k.axpy = axpyScalar;
+        k.backpropRow = backpropRowScalar;
+        k.gemmNT = gemmNTScalar;
+        k.gemmNN = gemmNNScalar;
+        k.gemmTN = gemmTNScalar;
+        k.expSpan = expSpanScalar;
+        k.tanhSpan = tanhSpanScalar;
+        k.sinSpan = sinSpanScalar;
+        k.cosSpan = cosSpanScalar;
+        k.fracSpan = fracSpanScalar;
+        k.absMax = absMaxScalar;
+        k.quantizeI8 = quantizeI8Scalar;
+        k.spmv = spmvScalar;
+        k.backpropRowSparse = backpropRowSparseScalar;
+        k.matvecI8 = matvecI8Scalar;
+        k.toBf16 = toBf16Scalar;
+        k.toHalf = toHalfScalar;
+        k.matvecBf16 = matvecBf16Scalar;
+        k.matvecHalf = matvecHalfScalar;
+        k.axpyBf16 = axpyBf16Scalar;
+        k.axpyHalf = axpyHalfScalar;
+#ifdef ANN_X86
+        // The AVX2 matrix tiles and approximations are also used on AVX-512 machines
+        if (isa >= AVX2) {
+            k.gemmNT = gemmNTAvx2;
+            k.gemmNN = gemmNNAvx2;
+            k.gemmTN = gemmTNAvx2;
+            k.expSpan = expSpanAvx2;
+            k.tanhSpan = tanhSpanAvx2;
+            k.sinSpan = sinSpanAvx2;
+            k.cosSpan = cosSpanAvx2;
+            k.fracSpan = fracSpanAvx2;
+            k.matvecI8 = matvecI8Avx2;
+        }
+        if (isa == AVX2) {
+            k.dot = dotAvx2;
+            k.matvec = matvecAvx2;
+            k.axpy = axpyAvx2;
+            k.backpropRow = backpropRowAvx2;
+            k.absMax = absMaxAvx2;
+            k.quantizeI8 = quantizeI8Avx2;
+            k.spmv = spmvAvx2;
+        } else if (isa == AVX512) {
+            k.dot = dotAvx512;
+            k.matvec = matvecAvx512;
+            k.axpy = axpyAvx512;
+            k.backpropRow = backpropRowAvx512;
+            k.absMax = absMaxAvx512;
+            k.quantizeI8 = quantizeI8Avx512;
+            k.spmv = spmvAvx512;
+            k.backpropRowSparse = backpropRowSparseAvx512;
+        }
+        if (isa == AVX2) {
+            k.matvecBf16 = matvec16Avx2<false>;
+            k.axpyBf16 = axpy16Avx2<false>;
+        }
+        if (isa == AVX2 && __builtin_cpu_supports("f16c")) {
+            k.matvecHalf = matvec16Avx2<true>;
+            k.axpyHalf = axpy16Avx2<true>;
+        }
+        if (isa >= AVX2 && __builtin_cpu_supports("f16c")) {
+            k.toHalf = toHalfF16c;
+        }
+        if (isa == AVX512) {
+            k.matvecBf16 = matvec16Avx512<false>;
+            k.matvecHalf = matvec16Avx512<true>;
+            k.axpyBf16 = axpy16Avx512<false>;
+            k.axpyHalf = axpy16Avx512<true>;
+        }
+        if (isa == AVX512 && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vnni")) {
+            k.matvecI8 = matvecI8Vnni;
+        }
+        if (isa == AVX512 && __builtin_cpu_supports("avx512bf16")) {
+            k.toBf16 = toBf16Avx512;
+        }
+#endif
+        return k;
+    }
+
+    static const Kernels& get() {
+        static const Kernels k = select(detect());
+        return k;
+    }
+
+    const char* name() const {
+        switch (isa) {
+            case AVX2: return "avx2";
+            case AVX512: return "avx512";
+            default: return "scalar";
+        }
+    }
+};
+
+
+#endif /* Kernels_h */
@@ -10,38 +10,113 @@
 
 #include <vector>
 #include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <new>
 #include "Activation.h"
+#include "Kernels.h"
+#include "ThreadPool.h"
+#include "Profiler.h"
 
 
-struct Node {
-    std::vector<float> W;
-    float beta;
-    float alpha;
-    float eval(const std::vector<float>& input) {
-        float z = beta;
-        for (int i = 0; i < input.size(); ++i) {
-            z += input[i] * W[i];
+/* *************************************************************** */
+/* Allocator for cache line aligned buffers */
+template <typename T, std::size_t Alignment = 64>
+struct AlignedAllocator {
+    typedef T value_type;
+    template <typename U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+    AlignedAllocator() {}
+    template <typename U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate(std::size_t count) {
+        std::size_t bytes = (count * sizeof(T) + Alignment - 1) / Alignment * Alignment;
+        void* ptr = std::aligned_alloc(Alignment, bytes);
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
         }
-        return z * alpha;
+        return static_cast<T*>(ptr);
     }
+
+    void deallocate(T* ptr, std::size_t) {
+        std::free(ptr);
+    }
+
+    template <typename U> bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+    template <typename U> bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
 };
 
+typedef std::vector<float, AlignedAllocator<float>> AlignedVector;
+typedef std::vector<uint16_t, AlignedAllocator<uint16_t>> AlignedHalves;
+
+// Rows or columns per block when a layer is split across the pool, a
+// multiple of 16 floats keeps the threads off each other's cache lines
+const int PARALLEL_GRAIN = 16;
+
+// Weights of a layer per pool thread, below this waking a worker costs
+// more than the share of the pass it takes over
+const int PARALLEL_MIN_WEIGHTS = 32768;
+
+
+/* *************************************************************** */
+/* Activations of one layer for one caller. Layer itself only holds the
+   weights, so several threads can share a Layer, each with its own state */
+struct LayerState {
+    void resize(int numOfInputs, int numOfOutputs) {
+        Z.resize(numOfOutputs);
+        Y.resize(numOfOutputs);
+        dE_dY.resize(numOfOutputs);
+        dE_dZ.resize(numOfOutputs);
+        dE_dX.resize(numOfInputs);
+        Xf.resize(numOfInputs);
+        Wx.resize(numOfOutputs);
+        batchSize = 0;
+    }
+
+    std::vector<float> Z;
+    std::vector<float> Y;
+    std::vector<float> dE_dY;       // error derivative arriving at the outputs
+    std::vector<float> dE_dZ;
+    std::vector<float> dE_dX;
+    std::vector<float> Xf;      // foreground inputs minus the background, see evalForeground
+    std::vector<float> Wx;
+    std::vector<float> Wxb;     // batch buffers, batchSize rows
+    std::vector<float> Zb;
+    std::vector<float> Yb;
+    std::vector<float> dE_dZb;
+    std::vector<float> dE_dXb;
+    int batchSize;
+};
 
 
-class Layer {
+/* *************************************************************** */
+/* Activation is either AFunction, dispatched at run time, or one of the
+   concrete (final) activation classes, which lets the compiler inline
+   eval/derivative into the node loops */
+template <typename Activation = AFunction>
+class LayerT {
 public:
-    Layer(int numOfInputs, int numOfOutputs, AFunction *activeFunction) {
+    LayerT(int numOfInputs, int numOfOutputs, Activation *activeFunction) {
         this->activeFunction = activeFunction;
         this->fast = true;
         Nx = numOfInputs;
         Ny = numOfOutputs;
-        node.resize(numOfOutputs, Node{
-           .W = std::vector<float>(numOfInputs),
-           .beta = 0
-        });
-        Z.resize(numOfOutputs);
-        Y.resize(numOfOutputs);
-        dE_dX.resize(numOfInputs);
+        // Every row starts on a cache line, the padding is kept at zero.
+        // Strides that are a multiple of 1KB map every row to the same
+        // cache sets, so those get one extra line.
+        stride = (numOfInputs + 15) & ~15;
+        if (stride % 256 == 0) {
+            stride += 16;
+        }
+        index = 0;
+        sparse = false;
+        hasBackground = false;
+        frozen = Float32;
+        storage.assign(blockSize(), 0.0f);
+        attach(storage.data());
+        pool = nullptr;
         
         /* *************************************************************** */
         /* Init values */
@@ -52,69 +127,617 @@ public:
         std::mt19937 gen(rd());
         std::normal_distribution<> d(0.0, 1.0);
  
-        for (int n = 0; n < node.size(); ++n) {
-            Node& inode = node[n];
+        for (int n = 0; n < numOfOutputs; ++n) {
+            float* w = row(n);
             for (int i = 0; i < numOfInputs; ++i) {
-                inode.W[i] = ( d(gen) / Nx );
+                w[i] = ( d(gen) / Nx );
+            }
+            beta[n] = initBeta;
+            alpha[n] = initAlpha;
+        }
+    }
+
+    float* row(int n) {
+        return W + (size_t)n * stride;
+    }
+
+    // Floats in the parameter block: the W rows, then alpha and beta,
+    // each padded to a cache line
+    size_t blockSize() const {
+        return (size_t)(int)Ny * stride + 2 * (((int)Ny + 15) & ~15);
+    }
+
+    // Points W, alpha and beta at a parameter block laid out as blockSize()
+    // describes, storage itself or a block of a mapped checkpoint.
+    // A pruned layer goes back to dense, the new block has its own zeros.
+    // A frozen layer goes back to float rows.
+    void attach(float* block) {
+        densify();
+        frozen = Float32;
+        AlignedHalves().swap(W16);
+        AlignedHalves().swap(WT16);
+        W = block;
+        alpha = block + (size_t)(int)Ny * stride;
+        beta = alpha + (((int)Ny + 15) & ~15);
+        if (block != storage.data()) {
+            AlignedVector().swap(storage);
+        }
+        if (hasBackground) {
+            transposeW();
+        }
+    }
+
+    // Runs body(from, to) over [begin, end), one pass over the layer
+    template <typename F>
+    void parallel(int begin, int end, F&& body) {
+        parallel(begin, end, sparse ? (double)values.size() : (double)(int)Nx * (int)Ny, body);
+    }
+
+    // With a pool every thread gets at least PARALLEL_MIN_WEIGHTS of the
+    // weights the pass reads, so a small pass, or a range of one block,
+    // stays on the calling thread
+    template <typename F>
+    void parallel(int begin, int end, double weights, F&& body) {
+        int threads = (int)(weights / PARALLEL_MIN_WEIGHTS);
+        if (pool != nullptr && pool->size() > 1 && threads > 1 && end - begin > PARALLEL_GRAIN) {
+            pool->parallelFor(begin, end, PARALLEL_GRAIN, body, threads);
+        } else {
+            body(begin, end);
+        }
+    }
+
+    /* *************************************************************** */
+    /* Frozen W. W never trains in this variant, so it can be kept in
+       BFloat16 or Float16 (W16, and WT16 for an input layer with a
+       background), which halves the bytes every pass reads. The float rows
+       are released, alpha and beta move to a block of their own.
+       Checkpoints and the engines get the rows widened back by writeBlock,
+       so the file format does not change. */
+    bool freeze(WeightStorage to) {
+        if (to == frozen) {
+            return true;
+        }
+        thaw();
+        if (to == Float32) {
+            return true;
+        }
+        if (sparse) {
+            std::cerr << "A pruned layer can not be frozen" << std::endl;
+            return false;
+        }
+        const Kernels& k = Kernels::get();
+        int nx = (int)Nx;
+        int padded = ((int)Ny + 15) & ~15;
+        W16.assign((size_t)(int)Ny * stride, 0);
+        for (int n = 0; n < (int)Ny; ++n) {
+            uint16_t* w = W16.data() + (size_t)n * stride;
+            if (to == BFloat16) {
+                k.toBf16(row(n), w, nx);
+            } else {
+                k.toHalf(row(n), w, nx);
+            }
+        }
+        AlignedVector nodes(2 * padded, 0.0f);
+        std::copy(alpha, alpha + padded, nodes.begin());
+        std::copy(beta, beta + padded, nodes.begin() + padded);
+        storage.swap(nodes);
+        W = nullptr;
+        alpha = storage.data();
+        beta = alpha + padded;
+        frozen = to;
+        if (hasBackground) {
+            transposeW();
+        }
+        return true;
+    }
+
+    // Back to float rows, which keep the rounding of the frozen ones
+    void thaw() {
+        if (frozen == Float32) {
+            return;
+        }
+        AlignedVector block(blockSize(), 0.0f);
+        writeBlock(block.data());
+        storage.swap(block);
+        attach(storage.data());
+    }
+
+    float weight(int n, int i) const {
+        size_t at = (size_t)n * stride + i;
+        switch (frozen) {
+            case BFloat16: return bf16ToFloat(W16[at]);
+            case Float16: return halfToFloat(W16[at]);
+            default: return W[at];
+        }
+    }
+
+    // The parameter block as blockSize() describes it
+    void writeBlock(float* out) const {
+        if (frozen == Float32) {
+            std::memcpy(out, W, blockSize() * sizeof(float));
+            return;
+        }
+        size_t rows = (size_t)(int)Ny * stride;
+        for (size_t j = 0; j < rows; ++j) {
+            out[j] = (frozen == BFloat16) ? bf16ToFloat(W16[j]) : halfToFloat(W16[j]);
+        }
+        std::memcpy(out + rows, alpha, 2 * (((int)Ny + 15) & ~15) * sizeof(float));
+    }
+
+    // y[n] = W[n,:] . x for the rows [from, to)
+    void matvecRows(const Kernels& k, int from, int to, const float* x, float* y) {
+        switch (frozen) {
+            case BFloat16: k.matvecBf16(to - from, (int)Nx, W16.data() + (size_t)from * stride, stride, x, y + from); break;
+            case Float16: k.matvecHalf(to - from, (int)Nx, W16.data() + (size_t)from * stride, stride, x, y + from); break;
+            default:
+                for (int n = from; n < to; ++n) {
+                    y[n] = k.dot(x, row(n), (int)Nx);
+                }
+        }
+    }
+
+    // y[from, to) += a * W[n, from:to)
+    void axpyRow(const Kernels& k, float a, int n, int from, int to, float* y) {
+        size_t at = (size_t)n * stride + from;
+        switch (frozen) {
+            case BFloat16: k.axpyBf16(a, W16.data() + at, y + from, to - from); break;
+            case Float16: k.axpyHalf(a, W16.data() + at, y + from, to - from); break;
+            default: k.axpy(a, W + at, y + from, to - from);
+        }
+    }
+
+    // y[from, to) += a * W[from:to, i], from the transposed copy
+    void axpyColumn(const Kernels& k, float a, int i, int from, int to, float* y) {
+        size_t at = (size_t)i * strideT + from;
+        switch (frozen) {
+            case BFloat16: k.axpyBf16(a, WT16.data() + at, y + from, to - from); break;
+            case Float16: k.axpyHalf(a, WT16.data() + at, y + from, to - from); break;
+            default: k.axpy(a, WT.data() + at, y + from, to - from);
+        }
+    }
+
+    /* *************************************************************** */
+    /* Pruning. The kept weights are copied into CSR arrays (rowStart,
+       column, values) that eval and updateWeights use from then on. W is
+       not trained in this variant, so it always matches the CSR values
+       and fine-tuning only moves alpha and beta. */
+
+    // Drops the weights with |w| < threshold, returns how many are kept
+    int pruneBelow(float threshold) {
+        thaw();
+        syncDense();
+        for (int n = 0; n < (int)Ny; ++n) {
+            float* w = row(n);
+            for (int i = 0; i < (int)Nx; ++i) {
+                if (std::fabs(w[i]) < threshold) {
+                    w[i] = 0.0f;
+                }
+            }
+        }
+        return compress();
+    }
+
+    // Keeps the k largest |w| of every node, returns how many are kept
+    int pruneTopK(int k) {
+        int nx = (int)Nx;
+        thaw();
+        syncDense();
+        if (k < nx) {
+            std::vector<float> magnitude(nx);
+            for (int n = 0; n < (int)Ny; ++n) {
+                float* w = row(n);
+                for (int i = 0; i < nx; ++i) {
+                    magnitude[i] = std::fabs(w[i]);
+                }
+                std::nth_element(magnitude.begin(), magnitude.begin() + (nx - k), magnitude.end());
+                float cut = magnitude[nx - k];
+                // ties with the cut are kept from the left until there are k
+                int above = 0;
+                for (int i = 0; i < nx; ++i) {
+                    above += (std::fabs(w[i]) > cut);
+                }
+                int ties = k - above;
+                for (int i = 0; i < nx; ++i) {
+                    float a = std::fabs(w[i]);
+                    if (a < cut || (a == cut && ties-- <= 0)) {
+                        w[i] = 0.0f;
+                    }
+                }
+            }
+        }
+        return compress();
+    }
+
+    // W already holds the CSR values, kept for the NeuralNetwork interface
+    void syncDense() {
+    }
+
+    // Back to using every weight of W
+    void densify() {
+        sparse = false;
+        std::vector<int>().swap(rowStart);
+        std::vector<int>().swap(column);
+        AlignedVector().swap(values);
+    }
+
+    // Builds the CSR arrays from the non-zero weights of W
+    int compress() {
+        rowStart.assign(1, 0);
+        column.clear();
+        values.clear();
+        for (int n = 0; n < (int)Ny; ++n) {
+            const float* w = row(n);
+            for (int i = 0; i < (int)Nx; ++i) {
+                if (w[i] != 0.0f) {
+                    column.push_back(i);
+                    values.push_back(w[i]);
+                }
+            }
+            rowStart.push_back((int)column.size());
+        }
+        sparse = true;
+        return (int)column.size();
+    }
+
+    // Entries [j0, j1) of row n whose columns are in [from, to)
+    void sparseRange(int n, int from, int to, int& j0, int& j1) const {
+        const int* begin = column.data() + rowStart[n];
+        const int* end = column.data() + rowStart[n + 1];
+        const int* first = std::lower_bound(begin, end, from);
+        j0 = (int)(first - column.data());
+        j1 = (int)(std::lower_bound(first, end, to) - column.data());
+    }
+
+    // Bytes of one dense weight
+    double weightBytes() const {
+        return (frozen == Float32) ? 4.0 : 2.0;
+    }
+
+    // Weights in the columns [from, to) of W, on average once pruned.
+    // Only the profiler counts with it.
+    double columnEntries(int from, int to) const {
+        return sparse ? (double)values.size() * (to - from) / (int)Nx : (double)(int)Ny * (to - from);
+    }
+
+    /* *************************************************************** */
+    /* Inputs that mostly sit at one background value b, like the MNIST
+       background pixels. With x = b + d, W x = b * rowSum + W d and d is
+       zero outside the foreground list of the sample. The foreground
+       weights are read as columns of W, from the transposed copy WT.
+       W does not train, so WT and rowSum only change with the weights
+       themselves. */
+    void setBackground(float value) {
+        background = value;
+        hasBackground = true;
+        strideT = ((int)Ny + 15) & ~15;
+        rowSum.assign((int)Ny, 0.0f);
+        transposeW();
+    }
+
+    // Column i of W
+    float* rowT(int i) {
+        return WT.data() + (size_t)i * strideT;
+    }
+
+    // A frozen layer keeps the transposed copy in WT16 only
+    void transposeW() {
+        int nx = (int)Nx;
+        WT.assign((size_t)nx * strideT, 0.0f);
+        for (int n = 0; n < (int)Ny; ++n) {
+            double sum = 0.0;
+            for (int i = 0; i < nx; ++i) {
+                float w = weight(n, i);
+                rowT(i)[n] = w;
+                sum += w;
             }
-            inode.beta = initBeta;
-            inode.alpha = initAlpha;
+            rowSum[n] = (float)sum;
+        }
+        if (frozen != Float32) {
+            const Kernels& k = Kernels::get();
+            WT16.assign(WT.size(), 0);
+            if (frozen == BFloat16) {
+                k.toBf16(WT.data(), WT16.data(), (int)WT.size());
+            } else {
+                k.toHalf(WT.data(), WT16.data(), (int)WT.size());
+            }
+            AlignedVector().swap(WT);
+        }
+    }
+
+    // eval for an input whose pixels outside foreground equal the background,
+    // W x is left in state.Wx for the update. Without a background, or
+    // once pruned, this is the plain eval.
+    void evalForeground(const std::vector<float>& input, const std::vector<int>& foreground, LayerState& state) {
+        if (!hasBackground || sparse) {
+            eval(input, state);
+            return;
+        }
+        const Kernels& k = Kernels::get();
+        int count = (int)foreground.size();
+        float* Xf = state.Xf.data();
+        for (int j = 0; j < count; ++j) {
+            Xf[j] = input[foreground[j]] - background;
         }
+        std::vector<float>& Wx = state.Wx;
+        std::vector<float>& Z = state.Z;
+        std::vector<float>& Y = state.Y;
+        parallel(0, (int)Ny, (double)count * (int)Ny, [&](int from, int to) {
+            {
+                ANN_PROFILE_SCOPE(index, PhaseEval, 2.0 * count * (to - from), weightBytes() * count * (to - from));
+                for (int n = from; n < to; ++n) {
+                    Wx[n] = background * rowSum[n];
+                }
+                for (int j = 0; j < count; ++j) {
+                    axpyColumn(k, Xf[j], foreground[j], from, to, Wx.data());
+                }
+                for (int n = from; n < to; ++n) {
+                    Z[n] = (beta[n] + Wx[n]) * alpha[n];
+                }
+            }
+            ANN_PROFILE_SCOPE(index, PhaseActivation, to - from, 8.0 * (to - from));
+            activeFunction->evalSpan(&Z[from], &Y[from], to - from);
+        });
     }
 
-    void eval(const std::vector<float>& input) {
-        for (int n = 0; n < node.size(); ++n) {
-            Z[n] = node[n].eval(input);
-            Y[n] = activeFunction->eval(Z[n]);
+    // updateWeights after evalForeground. This is the input layer, so no
+    // dE_dX is formed.
+    void updateWeightsForeground(const std::vector<float> &input, const std::vector<int>& foreground, float learningRate, const std::vector<float>& dE, LayerState& state) {
+        if (!hasBackground || sparse) {
+            updateWeights(input, learningRate, dE, state);
+            return;
         }
+        int ny = (int)Ny;
+        std::vector<float>& dE_dZ = state.dE_dZ;
+        {
+            ANN_PROFILE_SCOPE(index, PhaseGradient, 2.0 * ny, 16.0 * ny);
+            activeFunction->derivativeSpan(state.Z.data(), state.Y.data(), dE_dZ.data(), ny);
+            for (int n = 0; n < ny; n++) {
+                dE_dZ[n] *= dE[n];
+            }
+        }
+        ANN_PROFILE_SCOPE(index, PhaseUpdate, 7.0 * ny, 20.0 * ny);
+        updateNodes(learningRate, state);
     }
 
-    std::vector<float>* updateWeights(const std::vector<float> &input, float learningRate, const std::vector<float>& dE) {
+    // W x is left in state.Wx, the update needs it for the alpha gradient
+    void eval(const std::vector<float>& input, LayerState& state) {
+        const Kernels& k = Kernels::get();
+        std::vector<float>& Wx = state.Wx;
+        std::vector<float>& Z = state.Z;
+        std::vector<float>& Y = state.Y;
+        parallel(0, (int)Ny, [&](int from, int to) {
+            if (sparse) {
+                ANN_PROFILE_SCOPE(index, PhaseEval, 2.0 * (rowStart[to] - rowStart[from]), 8.0 * (rowStart[to] - rowStart[from]));
+                k.spmv(to - from, rowStart.data() + from, column.data(), values.data(), input.data(), Wx.data() + from);
+            } else {
+                ANN_PROFILE_SCOPE(index, PhaseEval, 2.0 * (int)Nx * (to - from), weightBytes() * (int)Nx * (to - from));
+                matvecRows(k, from, to, input.data(), Wx.data());
+            }
+            for (int n = from; n < to; ++n) {
+                Z[n] = (beta[n] + Wx[n]) * alpha[n];
+            }
+            // separate pass, so an inlined activation vectorizes
+            ANN_PROFILE_SCOPE(index, PhaseActivation, to - from, 8.0 * (to - from));
+            activeFunction->evalSpan(&Z[from], &Y[from], to - from);
+        });
+    }
+
+    std::vector<float>* updateWeights(const std::vector<float> &input, float learningRate, const std::vector<float>& dE, LayerState& state) {
+        const Kernels& k = Kernels::get();
+        int nx = (int)Nx;
+        int ny = (int)Ny;
+        std::vector<float>& Z = state.Z;
+        std::vector<float>& Y = state.Y;
+        std::vector<float>& dE_dZ = state.dE_dZ;
+        std::vector<float>& dE_dX = state.dE_dX;
+
         /* *********************************************************** */
         // calculate Transfer Gradients
-        std::vector<float> dE_dZ(Y.size());
-        for (int n = 0; n < Y.size(); n++) {
-            dE_dZ[n] = dE[n] * activeFunction->derivative(Z[n], Y[n]);
+        {
+            ANN_PROFILE_SCOPE(index, PhaseGradient, 2.0 * ny, 16.0 * ny);
+            activeFunction->derivativeSpan(Z.data(), Y.data(), dE_dZ.data(), ny);
+            for (int n = 0; n < ny; n++) {
+                dE_dZ[n] *= dE[n];
+            }
+        }
+
+        /* *********************************************************** */
+        // updating Alpha and bias, dE_dZ leaves scaled by the old alpha
+        {
+            ANN_PROFILE_SCOPE(index, PhaseUpdate, 7.0 * ny, 20.0 * ny);
+            updateNodes(learningRate, state);
         }
 
         /* *********************************************************** */
         // calculate Transfer Gradients for previous layer
         // if it's the input layer, there is no need to transfer gradients
 
-        for (int i = 0; i < input.size(); i++) {
-            dE_dX[i] = 0.0;
-            for (int n = 0; n < Y.size(); n++) {
-                dE_dX[i] += node[n].W[i] * dE_dZ[n] * node[n].alpha;
+        // dE_dX += dE_dZ[n] * W[n,:], streaming each row once.
+        // Threads take column slices so each owns its part of dE_dX.
+        parallel(0, nx, [&](int from, int to) {
+            ANN_PROFILE_SCOPE(index, PhaseBackprop, 2.0 * columnEntries(from, to), (sparse ? 8.0 : weightBytes()) * columnEntries(from, to));
+            std::fill(dE_dX.begin() + from, dE_dX.begin() + to, 0.0f);
+            for (int n = 0; n < ny; n++) {
+                if (sparse) {
+                    int j0, j1;
+                    sparseRange(n, from, to, j0, j1);
+                    float g = dE_dZ[n];
+                    for (int j = j0; j < j1; ++j) {
+                        dE_dX[column[j]] += g * values[j];
+                    }
+                } else {
+                    axpyRow(k, dE_dZ[n], n, from, to, dE_dX.data());
+                }
             }
+        });
+
+        return &dE_dX;
+    }
+
+    /* *************************************************************** */
+    /* Mini-batch versions, samples are rows of count x Nx blocks. W is
+       fixed, so W x of the batch is one GEMM, kept in Wxb for the alpha
+       gradient, and dE_dX another. alpha and beta take the gradients
+       summed over the batch. */
+    void resizeBatch(int count, LayerState& state) {
+        if (state.batchSize == count) {
+            return;
         }
+        state.batchSize = count;
+        state.Wxb.resize((size_t)count * (int)Ny);
+        state.Zb.resize((size_t)count * (int)Ny);
+        state.Yb.resize((size_t)count * (int)Ny);
+        state.dE_dZb.resize((size_t)count * (int)Ny);
+        state.dE_dXb.resize((size_t)count * (int)Nx);
+    }
+
+    void evalBatch(const float* input, int count, LayerState& state) {
+        const Kernels& k = Kernels::get();
+        int nx = (int)Nx;
+        int ny = (int)Ny;
+        resizeBatch(count, state);
+        std::vector<float>& Wxb = state.Wxb;
+        std::vector<float>& Zb = state.Zb;
+        std::vector<float>& Yb = state.Yb;
+        parallel(0, ny, [&](int from, int to) {
+            if (sparse) {
+                ANN_PROFILE_SCOPE(index, PhaseEval, 2.0 * count * (rowStart[to] - rowStart[from]), 8.0 * count * (rowStart[to] - rowStart[from]));
+                for (int b = 0; b < count; ++b) {
+                    k.spmv(to - from, rowStart.data() + from, column.data(), values.data(), input + (size_t)b * nx, &Wxb[(size_t)b * ny + from]);
+                }
+            } else if (frozen != Float32) {
+                // there is no 16 bit GEMM, the rows are read once per sample
+                ANN_PROFILE_SCOPE(index, PhaseEval, 2.0 * count * nx * (to - from), weightBytes() * count * nx * (to - from));
+                for (int b = 0; b < count; ++b) {
+                    matvecRows(k, from, to, input + (size_t)b * nx, &Wxb[(size_t)b * ny]);
+                }
+            } else {
+                ANN_PROFILE_SCOPE(index, PhaseEval, 2.0 * count * nx * (to - from), 4.0 * nx * (to - from + count));
+                k.gemmNT(count, to - from, nx, input, nx, row(from), stride, Wxb.data() + from, ny);
+            }
+            ANN_PROFILE_SCOPE(index, PhaseActivation, count * (to - from), 8.0 * count * (to - from));
+            for (int b = 0; b < count; ++b) {
+                const float* wx = &Wxb[(size_t)b * ny];
+                float* z = &Zb[(size_t)b * ny];
+                for (int n = from; n < to; ++n) {
+                    z[n] = (beta[n] + wx[n]) * alpha[n];
+                }
+                activeFunction->evalSpan(z + from, &Yb[(size_t)b * ny] + from, to - from);
+            }
+        });
+    }
 
+    // Gradients are summed over the batch, so a batch of one matches updateWeights
+    const float* updateWeightsBatch(const float* input, int count, float learningRate, const float* dE, LayerState& state) {
+        const Kernels& k = Kernels::get();
+        int nx = (int)Nx;
+        int ny = (int)Ny;
+        std::vector<float>& dE_dZb = state.dE_dZb;
+        std::vector<float>& dE_dXb = state.dE_dXb;
+        const float* Wxb = state.Wxb.data();
 
         /* *********************************************************** */
-        // updating Alpha and bias
-        for (int n = 0; n < node.size(); ++n) {
-            Node& inode = node[n];
-            float palpha = inode.alpha;
-            float dZ_dalpha = inode.beta;
-            for (int i = 0; i < input.size(); ++i) {
-                dZ_dalpha += inode.W[i] * input[i];
+        // calculate Transfer Gradients
+        {
+            ANN_PROFILE_SCOPE(index, PhaseGradient, 2.0 * count * ny, 16.0 * count * ny);
+            activeFunction->derivativeSpan(state.Zb.data(), state.Yb.data(), dE_dZb.data(), count * ny);
+            for (size_t j = 0; j < (size_t)count * ny; ++j) {
+                dE_dZb[j] *= dE[j];
             }
-            inode.alpha -= (learningRate) * dZ_dalpha * dE_dZ[n];
-            inode.beta -= (learningRate) * palpha * dE_dZ[n];
         }
 
-        return &dE_dX;
+        /* *********************************************************** */
+        // updating Alpha and bias from the batch sums, as updateNodes
+        {
+            ANN_PROFILE_SCOPE(index, PhaseUpdate, 5.0 * count * ny, 12.0 * count * ny);
+            for (int n = 0; n < ny; n++) {
+                float palpha = alpha[n];
+                float dAlpha = 0.0f;
+                float dBeta = 0.0f;
+                for (int b = 0; b < count; ++b) {
+                    float& g = dE_dZb[(size_t)b * ny + n];
+                    dAlpha += (beta[n] + Wxb[(size_t)b * ny + n]) * g;
+                    dBeta += g;
+                    g *= palpha;
+                }
+                alpha[n] = palpha - learningRate * dAlpha;
+                beta[n] -= learningRate * palpha * dBeta;
+            }
+        }
+
+        /* *********************************************************** */
+        // calculate Transfer Gradients for previous layer, dE_dX = dE_dZ W
+        parallel(0, nx, [&](int from, int to) {
+            ANN_PROFILE_SCOPE(index, PhaseBackprop, 2.0 * count * columnEntries(from, to), (sparse ? 8.0 : weightBytes()) * columnEntries(from, to) + 4.0 * count * (ny + to - from));
+            if (sparse || frozen != Float32) {
+                for (int b = 0; b < count; ++b) {
+                    const float* g = &dE_dZb[(size_t)b * ny];
+                    float* dx = &dE_dXb[(size_t)b * nx];
+                    std::fill(dx + from, dx + to, 0.0f);
+                    for (int n = 0; n < ny; n++) {
+                        if (sparse) {
+                            int j0, j1;
+                            sparseRange(n, from, to, j0, j1);
+                            for (int j = j0; j < j1; ++j) {
+                                dx[column[j]] += g[n] * values[j];
+                            }
+                        } else {
+                            axpyRow(k, g[n], n, from, to, dx);
+                        }
+                    }
+                }
+            } else {
+                k.gemmNN(count, ny, to - from, dE_dZb.data(), ny, W + from, stride, dE_dXb.data() + from, nx);
+            }
+        });
+
+        return dE_dXb.data();
     }
     
     
+    // Z = (beta + W x) alpha, with W x cached in state.Wx by eval, so
+    // dZ_dalpha = beta + W x and dZ_dbeta = alpha need no pass over W.
+    // dE_dZ is scaled by the old alpha in the same loop, it is then the
+    // weight of each row of W in dE_dX.
+    void updateNodes(float learningRate, LayerState& state) {
+        int ny = (int)Ny;
+        float* dE_dZ = state.dE_dZ.data();
+        const float* Wx = state.Wx.data();
+        for (int n = 0; n < ny; n++) {
+            float g = dE_dZ[n];
+            float palpha = alpha[n];
+            alpha[n] = palpha - learningRate * (beta[n] + Wx[n]) * g;
+            beta[n] -= learningRate * palpha * g;
+            dE_dZ[n] = g * palpha;
+        }
+    }
+
 public:
-    std::vector<Node> node;
-    std::vector<float> Z;
-    std::vector<float> Y;
-    std::vector<float> dE_dX;
-    AFunction* activeFunction;
+    float* W;               // Ny rows of stride floats, row-major
+    float* alpha;
+    float* beta;
+    AlignedVector storage;  // parameter block, released when a checkpoint is mapped, only alpha and beta when frozen
+    WeightStorage frozen;   // BFloat16 or Float16 once freeze has moved W into W16
+    AlignedHalves W16;      // rows of W when frozen, W is then nullptr
+    AlignedHalves WT16;     // WT when frozen
+    bool sparse;            // set by pruning, then the CSR arrays hold the weights
+    std::vector<int> rowStart;
+    std::vector<int> column;
+    AlignedVector values;
+    bool hasBackground;     // set by setBackground, for the input layer
+    float background;
+    AlignedVector WT;       // Nx rows of strideT floats, the columns of W
+    int strideT;
+    AlignedVector rowSum;   // sum of each row of W
+    Activation* activeFunction;
+    ThreadPool* pool;       // not owned, set by NeuralNetwork::setThreads
+    int index;              // position in the network, for the profiler
     float Nx;
     float Ny;
+    int stride;
     bool fast;
 };
 
+typedef LayerT<AFunction> Layer;
+
 #endif /* Layer_hpp */
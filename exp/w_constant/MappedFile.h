@@ -0,0 +1,84 @@
+//
+//  MappedFile.h
+//  Mnist_Multi_Layers
+//
+//  Read-only view of a whole file through mmap. The pages are shared
+//  with the page cache, so several processes reading the same dataset
+//  keep a single copy in memory.
+//
+
+#ifndef MappedFile_h
+#define MappedFile_h
+
+#include <string>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+class MappedFile {
+public:
+    MappedFile() : data(nullptr), length(0) {}
+
+    MappedFile(const std::string& path) : data(nullptr), length(0) {
+        open(path);
+    }
+
+    ~MappedFile() {
+        close();
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // writable gives a private copy-on-write mapping, changes never reach the file
+    bool open(const std::string& path, bool writable = false) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        int protection = writable ? (PROT_READ | PROT_WRITE) : PROT_READ;
+        void* ptr = mmap(nullptr, (size_t)info.st_size, protection, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (ptr == MAP_FAILED) {
+            return false;
+        }
+        data = static_cast<uint8_t*>(ptr);
+        length = (size_t)info.st_size;
+        return true;
+    }
+
+    void close() {
+        if (data != nullptr) {
+            munmap(data, length);
+        }
+        data = nullptr;
+        length = 0;
+    }
+
+    bool isOpen() const {
+        return data != nullptr;
+    }
+
+    // Exchanges the mappings, so a new file can be validated before it replaces the current one
+    void swap(MappedFile& other) {
+        std::swap(data, other.data);
+        std::swap(length, other.length);
+    }
+
+    uint8_t* data;
+    size_t length;
+};
+
+
+#endif /* MappedFile_h */